@@ -1,4 +1,5 @@
 #include "llvm/Pass.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
@@ -17,16 +18,56 @@
 #include "llvm/CodeGen/ValueTypes.h"
 #include "llvm/CodeGen/Analysis.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Support/LowLevelTypeImpl.h"
+#include "llvm/Support/CommandLine.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include <deque>
+#include <map>
+#include <set>
+#include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "memsafe"
+
+STATISTIC(NumBoundsChecks, "Number of inline bounds checks inserted");
+STATISTIC(NumEscapeChecks, "Number of IsSafeToEscape checks inserted");
+STATISTIC(NumChecksStaticallySafe, "Number of accesses proven in bounds at compile time");
+STATISTIC(NumChecksStaticallyUnsafe, "Number of accesses proven out of bounds at compile time");
+STATISTIC(NumChecksSubsumed, "Number of checks covered by a dominating check");
+STATISTIC(NumChecksMerged, "Number of checks merged into a widened check");
+STATISTIC(NumChecksHoisted, "Number of loop checks replaced by a range check in the preheader");
+STATISTIC(NumLoopsVersioned, "Number of loops copied without checks for their in-bounds iterations");
+
+static cl::opt<bool> SATBBarrier("memsafe-satb-barrier",
+	cl::desc("Log the old value of every store for SafeGC's concurrent marking"),
+	cl::init(false));
+
+static cl::opt<bool> EliminateChecks("memsafe-eliminate-checks",
+	cl::desc("Remove bounds and escape checks covered by a dominating check"),
+	cl::init(true));
+
+static cl::opt<bool> HoistLoopChecks("memsafe-hoist-loop-checks",
+	cl::desc("Check the address range of affine accesses once before their loop"),
+	cl::init(true));
+
 namespace {
 struct MemSafe : public FunctionPass {
   static char ID;
@@ -35,6 +76,9 @@ struct MemSafe : public FunctionPass {
 
 	void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
   }
 
   bool runOnFunction(Function &F) override;
@@ -177,6 +221,28 @@ void convertAllocaToMyMalloc(Function &F, const TargetLibraryInfo *TLI){
 		CallInst::Create(fnFree, {callInstMalloc}, "", CI_stackRestore);
 }
 
+/*
+ * MemSafe runs before mem2reg, when loop counters still live in allocas
+ * and ScalarEvolution can not see them. Integer locals narrower than a
+ * pointer are promoted to registers first: their accesses are always in
+ * bounds, and they can not hold a pointer the stack scanning would miss.
+ */
+void promoteIntegerLocals(Function &F, DominatorTree &DT){
+
+	const DataLayout &DL = F.getParent()->getDataLayout();
+	std::vector<AllocaInst*> allocas;
+
+	for(Instruction &I : F.getEntryBlock()){
+		auto *AI = dyn_cast<AllocaInst>(&I);
+		if(AI and AI->getAllocatedType()->isIntegerTy() and isAllocaPromotable(AI)
+				and DL.getTypeSizeInBits(AI->getAllocatedType()) < 64)
+			allocas.push_back(AI);
+	}
+
+	if(not allocas.empty())
+		PromoteMemToReg(allocas, DT);
+}
+
 Value* findBasePtr(Value *ptr){
 	while(true){
 		if(auto *BI = dyn_cast<BitCastInst>(ptr))	
@@ -196,9 +262,9 @@ Value* insertBitCastIfNeeded(Function &F, Value *from, Instruction *insertBefore
 	return BitCastInst::Create(Instruction::CastOps::BitCast, from, getInt8PtrTy(F), "", insertBefore);
 }
 
-void insertCheckForOutOfBoundPointer(Function &F, const TargetLibraryInfo *TLI){
+// (ptr, Instruction above which check is inserted) for pointers that escape the function
+std::set<std::pair<Value*, Value*>> collectEscapingPointers(Function &F, const TargetLibraryInfo *TLI){
 	
-	// (ptr, Instruction above which check is inserted)
 	std::set<std::pair<Value*, Value*>> pointersToTrack;
 	
 	for (BasicBlock &BB : F) {
@@ -224,24 +290,12 @@ void insertCheckForOutOfBoundPointer(Function &F, const TargetLibraryInfo *TLI){
 				pointersToTrack.insert({SI -> getOperand(0), SI});
 		}
 	}
-	
-	for(auto ptr_Inst: pointersToTrack){
-
-		Value *ptr = ptr_Inst.first;
-		auto *basePtr = findBasePtr(ptr);
-		Instruction *insertBefore = dyn_cast<Instruction>(ptr_Inst.second);
-
-		basePtr = insertBitCastIfNeeded(F, basePtr, insertBefore);	// convert baseptr to i8*
-		ptr = insertBitCastIfNeeded(F, ptr, insertBefore);
-
-		auto fnEscape = F.getParent()->getOrInsertFunction("IsSafeToEscape", getVoidTy(F), getInt8PtrTy(F), getInt8PtrTy(F));
-		CallInst::Create(fnEscape, {basePtr, ptr}, "", insertBefore);
-	}
+	return pointersToTrack;
 }
 
-void addBoundsCheck(Function &F, const TargetLibraryInfo *TLI){
+// (ptr, Instruction above which check is needed) for every load and store
+std::set<std::pair<Value*, Value*>> collectAccessedPointers(Function &F){
 
-	// (ptr, Instruction above which check is needed)
 	std::set<std::pair<Value*, Value*>> pointersToTrack;
 
 	for (BasicBlock &BB : F) {
@@ -254,37 +308,64 @@ void addBoundsCheck(Function &F, const TargetLibraryInfo *TLI){
 				pointersToTrack.insert({LI->getOperand(0), LI});
 		}
 	}
+	return pointersToTrack;
+}
+
+/*
+ * A check that [Root + Lo, Root + Hi) lies within the object Base points
+ * into. An escape check (IsSafeToEscape) is the check of a single byte.
+ */
+struct MemCheck {
+	Instruction *At;
+	Value *Base;
+	Value *Ptr;
+	Value *Root;
+	int64_t Lo;
+	int64_t Hi;
+	bool IsEscape;
+	// the size of Base is that of its pointee type, see collectChecks
+	bool SizeFromType;
+	bool Eliminated;
+	// a check hoisted out of a loop also covers [Last + Lo, Last + Hi) and
+	// the accesses in between, Iterations steps of Stride bytes from Root
+	Value *Last;
+	Value *Iterations;
+	uint64_t Stride;
+};
+
+void addCheck(std::vector<MemCheck> &checks, const DataLayout &DL, Instruction *At, Value *basePtr,
+				Value *ptr, uint64_t size, bool isEscape, bool sizeFromType){
+
+	APInt offset(DL.getIndexTypeSizeInBits(ptr->getType()), 0);
+	Value *root = ptr->stripAndAccumulateConstantOffsets(DL, offset, /* AllowNonInbounds */ true);
+	int64_t lo = offset.getSExtValue();
+	checks.push_back({At, basePtr, ptr, root, lo, lo + (int64_t)size, isEscape, sizeFromType, false,
+						NULL, NULL, 0});
+}
+
+std::vector<MemCheck> collectChecks(Function &F, const TargetLibraryInfo *TLI){
 
 	const DataLayout &DL = F.getParent()->getDataLayout();
+	std::vector<MemCheck> checks;
 
-	for(auto ptr_Inst: pointersToTrack){
-		
+	for(auto ptr_Inst: collectEscapingPointers(F, TLI)){
 		Value *ptr = ptr_Inst.first;
-		auto *basePtr = findBasePtr(ptr);
-		Instruction *insertBefore = dyn_cast<Instruction>(ptr_Inst.second);
+		addCheck(checks, DL, cast<Instruction>(ptr_Inst.second), findBasePtr(ptr), ptr, 1, true, false);
+	}
 
-		bool needBoundsCheckWithSize = true;
-		Value *bytesAllocated = NULL;
+	for(auto ptr_Inst: collectAccessedPointers(F)){
 
-		if(auto *AI = dyn_cast<AllocaInst>(basePtr)){
-
-			if(IsAllocaInstVLA(AI, DL))
-				bytesAllocated = IRBuilder<>(AI).CreateMul(AI->getOperand(0),
-														getConstantInt(F, DL.getTypeAllocSize(AI->getAllocatedType())));
-			else
-				bytesAllocated = getConstantInt(F, *AI->getAllocationSizeInBits(DL) / 8);
-		}
+		Value *ptr = ptr_Inst.first;
+		auto *basePtr = findBasePtr(ptr);
+		Instruction *insertBefore = dyn_cast<Instruction>(ptr_Inst.second);
+		bool sizeFromType = false;
 
-		else if(isa<StoreInst>(insertBefore) and isa<GEPOperator>(basePtr)){
+		if(isa<GEPOperator>(basePtr) and (isa<StoreInst>(insertBefore) or
+						isa<GlobalVariable>(dyn_cast<GEPOperator>(basePtr)->getOperand(0)))){
 			// global ptr
 			basePtr = dyn_cast<GEPOperator>(basePtr)->getOperand(0);
-			bytesAllocated = getConstantInt(F, DL.getTypeAllocSize(basePtr->getType()->getPointerElementType()));
+			sizeFromType = true;
 		}
-		else
-			needBoundsCheckWithSize = false;
-
-		basePtr = insertBitCastIfNeeded(F, basePtr, insertBefore);
-		ptr = insertBitCastIfNeeded(F, ptr, insertBefore);
 
 		size_t accessSize = 0;
 
@@ -293,17 +374,731 @@ void addBoundsCheck(Function &F, const TargetLibraryInfo *TLI){
 		else
 			accessSize = DL.getTypeAllocSize(insertBefore->getType());
 
-		if(needBoundsCheckWithSize){
-			auto BoundFn = F.getParent()->getOrInsertFunction("BoundsCheckWithSize", getVoidTy(F),
-															getInt8PtrTy(F), getInt8PtrTy(F),
-															bytesAllocated -> getType(), getInt64Ty(F));
-			CallInst::Create(BoundFn, {basePtr, ptr, bytesAllocated, getConstantInt(F, accessSize)}, "", insertBefore);
+		addCheck(checks, DL, insertBefore, basePtr, ptr, accessSize, false, sizeFromType);
+	}
+	return checks;
+}
+
+// a load or store that is out of bounds whenever it executes
+class DiagnosticInfoOutOfBounds : public DiagnosticInfoWithLocationBase {
+	const Twine &Msg;
+
+public:
+	DiagnosticInfoOutOfBounds(const Function &Fn, const DiagnosticLocation &Loc, const Twine &Msg)
+		: DiagnosticInfoWithLocationBase(getKindID(), DS_Warning, Fn, Loc), Msg(Msg) {}
+
+	static DiagnosticKind getKindID() {
+		static int Kind = getNextAvailablePluginDiagnosticKind();
+		return (DiagnosticKind)Kind;
+	}
+
+	static bool classof(const DiagnosticInfo *DI) {
+		return DI->getKind() == getKindID();
+	}
+
+	void print(DiagnosticPrinter &DP) const override {
+		DP << getLocationStr() << ": in function " << getFunction().getName() << ": " << Msg;
+	}
+};
+
+/*
+ * the size of the object Root points into and Root's offset in it, when
+ * both are constant; mymalloc calls of a constant size count as objects
+ */
+bool getStaticObjectSize(Value *Root, const DataLayout &DL, const TargetLibraryInfo *TLI,
+							int64_t &size, int64_t &offset){
+
+	APInt rootOffset(DL.getIndexTypeSizeInBits(Root->getType()), 0);
+	auto *CI = dyn_cast<CallInst>(Root->stripAndAccumulateConstantOffsets(DL, rootOffset, true));
+	if(CI and CI->getCalledFunction() and CI->getCalledFunction()->getName() == "mymalloc"
+			and CI->getNumArgOperands() == 1 and isa<ConstantInt>(CI->getArgOperand(0))){
+		size = cast<ConstantInt>(CI->getArgOperand(0))->getZExtValue();
+		offset = rootOffset.getSExtValue();
+		return true;
+	}
+
+	ObjectSizeOffsetVisitor visitor(DL, TLI, Root->getContext());
+	SizeOffsetType sizeOffset = visitor.compute(Root);
+	if(not ObjectSizeOffsetVisitor::bothKnown(sizeOffset))
+		return false;
+	size = sizeOffset.first.getZExtValue();
+	offset = sizeOffset.second.getSExtValue();
+	return true;
+}
+
+/*
+ * drops the bounds checks of accesses at a known offset into an object of
+ * known size (allocas, globals, constant-sized mymalloc calls) that are in
+ * bounds; the ones that are not keep their check and get a warning
+ */
+void removeStaticallySafeChecks(Function &F, std::vector<MemCheck> &checks, const TargetLibraryInfo *TLI){
+
+	const DataLayout &DL = F.getParent()->getDataLayout();
+
+	for(auto &check: checks){
+
+		if(check.IsEscape or check.Eliminated)
+			continue;
+
+		int64_t size, offset;
+		if(not getStaticObjectSize(check.Root, DL, TLI, size, offset))
+			continue;
+
+		int64_t lo = offset + check.Lo;
+		int64_t hi = offset + check.Hi;
+
+		if(lo >= 0 and hi <= size){
+			check.Eliminated = true;
+			NumChecksStaticallySafe++;
+			continue;
 		}
-		else{
-			auto BoundFn = F.getParent()->getOrInsertFunction("BoundsCheck", getVoidTy(F),
-															getInt8PtrTy(F), getInt8PtrTy(F), getInt64Ty(F));
-			CallInst::Create(BoundFn, {basePtr, ptr, getConstantInt(F, accessSize)}, "", insertBefore);
+
+		std::string msg = "access to bytes [" + std::to_string(lo) + ", " + std::to_string(hi) +
+							") of a " + std::to_string(size) + "-byte object is out of bounds";
+		F.getContext().diagnose(DiagnosticInfoOutOfBounds(F, check.At->getDebugLoc(), msg));
+		NumChecksStaticallyUnsafe++;
+	}
+}
+
+/*
+ * Value numbering for the check elimination, over the dominator tree: two
+ * values get the same number when they compute the same expression of the
+ * same numbers, so that the reloads of a local variable at -O0 compare
+ * equal. A load is numbered with the version of the memory it reads.
+ * Stores to an alloca that is never captured only change the version of
+ * that alloca; stores through pointers that can not reach such an alloca
+ * change the version of the rest of memory; calls, stores that may reach
+ * an alloca other than through its own address (a phi or select of
+ * allocas), and blocks with several predecessors start new versions of
+ * everything.
+ */
+class CheckNumbering {
+public:
+	typedef std::vector<uintptr_t> Key;
+
+	CheckNumbering(Function &F, const DataLayout &DL) : DL(DL) {
+		for(Instruction &I : instructions(F))
+			if(auto *AI = dyn_cast<AllocaInst>(&I))
+				if(not PointerMayBeCaptured(AI, true, true))
+					LocalAllocas.insert(AI);
+	}
+
+	// the memory versions seen by one block, passed on to the blocks it dominates
+	struct Versions {
+		unsigned Memory = 0;
+		unsigned Floor = 0;
+		std::map<AllocaInst*, unsigned> Locals;
+	};
+
+	Value* getNumber(Value *V) {
+		auto It = Leaders.find(V);
+		return It == Leaders.end() ? V : It->second;
+	}
+
+	void invalidateAll(Versions &Ver) {
+		Ver.Memory = Ver.Floor = ++Counter;
+		Ver.Locals.clear();
+	}
+
+	// numbers I and applies its effect on memory; new table entries are recorded in Scope
+	void visit(Instruction &I, Versions &Ver, std::vector<Key> &Scope) {
+
+		Key K;
+		if(auto *LI = dyn_cast<LoadInst>(&I)) {
+			if(not LI->isVolatile())
+				K = {I.getOpcode(), (uintptr_t)I.getType(), (uintptr_t)getNumber(LI->getPointerOperand()),
+					 getVersion(LI->getPointerOperand(), Ver)};
+		}
+		else if(isa<GetElementPtrInst>(I) or isa<CastInst>(I) or isa<BinaryOperator>(I)) {
+			K = {I.getOpcode(), (uintptr_t)I.getType()};
+			if(auto *GEP = dyn_cast<GetElementPtrInst>(&I))
+				K.push_back((uintptr_t)GEP->getSourceElementType());
+			for(Value *Op : I.operands())
+				K.push_back((uintptr_t)getNumber(Op));
+		}
+
+		if(not K.empty()) {
+			auto It = Table.find(K);
+			if(It != Table.end())
+				Leaders[&I] = It->second;
+			else {
+				Table[K] = &I;
+				Scope.push_back(K);
+			}
+		}
+
+		if(auto *SI = dyn_cast<StoreInst>(&I)) {
+			bool unresolved;
+			AllocaInst *AI = getLocalObject(SI->getPointerOperand(), unresolved);
+			if(AI)
+				Ver.Locals[AI] = ++Counter;
+			else if(unresolved)
+				invalidateAll(Ver);
+			else
+				Ver.Memory = ++Counter;
+		}
+		else if(I.mayWriteToMemory())
+			invalidateAll(Ver);
+	}
+
+	void leaveScope(std::vector<Key> &Scope) {
+		for(auto &K : Scope)
+			Table.erase(K);
+	}
+
+private:
+	/*
+	 * the local alloca Ptr points into, or NULL; Unresolved is set when Ptr
+	 * may still point into one, e.g. through a phi or select of allocas
+	 */
+	AllocaInst* getLocalObject(Value *Ptr, bool &Unresolved) {
+		Value *Obj = GetUnderlyingObject(Ptr, DL, /* MaxLookup */ 0);
+		auto *AI = dyn_cast<AllocaInst>(Obj);
+		Unresolved = false;
+		if(AI and LocalAllocas.count(AI))
+			return AI;
+		// an uncaptured alloca is only reached through pointers computed from it
+		Unresolved = not (AI or isa<Argument>(Obj) or isa<Constant>(Obj) or isa<LoadInst>(Obj)
+							or isa<CallBase>(Obj) or isa<IntToPtrInst>(Obj));
+		return NULL;
+	}
+
+	unsigned getVersion(Value *Ptr, Versions &Ver) {
+		bool unresolved;
+		AllocaInst *AI = getLocalObject(Ptr, unresolved);
+		// a load that may read any local is never numbered like another one
+		if(unresolved)
+			return ++Counter;
+		if(not AI)
+			return Ver.Memory;
+		auto It = Ver.Locals.find(AI);
+		return It == Ver.Locals.end() ? Ver.Floor : It->second;
+	}
+
+	const DataLayout &DL;
+	std::set<AllocaInst*> LocalAllocas;
+	std::map<Key, Value*> Table;
+	std::map<Value*, Value*> Leaders;
+	unsigned Counter = 0;
+};
+
+struct CheckElimination {
+	typedef std::pair<Value*, Value*> CheckKey;
+
+	CheckNumbering &Numbering;
+	std::map<Instruction*, std::vector<MemCheck*>> &ChecksAt;
+	// checks that dominate the current block, by (base, root)
+	std::map<CheckKey, std::vector<MemCheck*>> Available;
+
+	CheckElimination(CheckNumbering &Numbering, std::map<Instruction*, std::vector<MemCheck*>> &ChecksAt)
+		: Numbering(Numbering), ChecksAt(ChecksAt) {}
+
+	bool isCovered(CheckKey &key, MemCheck *check) {
+		for(auto *other : Available[key])
+			if(other->Lo <= check->Lo and check->Hi <= other->Hi)
+				return true;
+		return false;
+	}
+
+	void visitBlock(DomTreeNode *Node, CheckNumbering::Versions Ver) {
+
+		BasicBlock *BB = Node->getBlock();
+		std::vector<CheckNumbering::Key> scope;
+		std::vector<CheckKey> availableScope;
+		// bounds checks in this block that later ones can be merged into
+		std::map<CheckKey, MemCheck*> widenable;
+
+		if(not BB->getSinglePredecessor())
+			Numbering.invalidateAll(Ver);
+
+		for(Instruction &I : *BB) {
+
+			for(auto *check : ChecksAt[&I]) {
+				CheckKey key = {Numbering.getNumber(check->Base), Numbering.getNumber(check->Root)};
+
+				if(isCovered(key, check)) {
+					check->Eliminated = true;
+					NumChecksSubsumed++;
+					continue;
+				}
+
+				auto It = widenable.find(key);
+				if(not check->IsEscape and It != widenable.end()) {
+					It->second->Lo = std::min(It->second->Lo, check->Lo);
+					It->second->Hi = std::max(It->second->Hi, check->Hi);
+					check->Eliminated = true;
+					NumChecksMerged++;
+					continue;
+				}
+
+				Available[key].push_back(check);
+				availableScope.push_back(key);
+				if(not check->IsEscape)
+					widenable[key] = check;
+			}
+
+			// a failing check must not move across a call, which may have visible effects
+			if(isa<CallInst>(I) and not isa<DbgInfoIntrinsic>(I))
+				widenable.clear();
+
+			Numbering.visit(I, Ver, scope);
+		}
+
+		for(auto *Child : Node->getChildren())
+			visitBlock(Child, Ver);
+
+		for(auto &key : availableScope)
+			Available[key].pop_back();
+		Numbering.leaveScope(scope);
+	}
+};
+
+/*
+ * drops the checks that an earlier check on the same base and root covers,
+ * and merges checks of constant offsets from the same root in a block into
+ * the first one, widened to cover them all
+ */
+void eliminateRedundantChecks(Function &F, std::vector<MemCheck> &checks, DominatorTree &DT){
+
+	std::map<Instruction*, std::vector<MemCheck*>> checksAt;
+	for(auto &check : checks)
+		checksAt[check.At].push_back(&check);
+
+	CheckNumbering numbering(F, F.getParent()->getDataLayout());
+	CheckElimination elimination(numbering, checksAt);
+	elimination.visitBlock(DT.getRootNode(), CheckNumbering::Versions());
+}
+
+// [Start, End) of the object a base pointer points into
+struct ObjectBounds {
+	Value *Start;
+	Value *End;
+};
+
+ObjectBounds getKnownBounds(Function &F, Value *basePtr, Value *bytesAllocated, Instruction *insertBefore){
+
+	IRBuilder<> IRB(insertBefore);
+	Value *start = IRB.CreatePointerCast(basePtr, getInt8PtrTy(F));
+	return {start, IRB.CreateGEP(start, bytesAllocated)};
+}
+
+ObjectBounds getHeapBounds(Function &F, Value *basePtr, Instruction *insertBefore){
+
+	// { i8* start, i64 size }, returned in registers
+	auto *boundsTy = StructType::get(getInt8PtrTy(F), getInt64Ty(F));
+	auto BoundsFn = F.getParent()->getOrInsertFunction("GetObjectBounds", boundsTy, getInt8PtrTy(F));
+	if(auto *Fn = dyn_cast<Function>(BoundsFn.getCallee())){
+		Fn->setOnlyReadsMemory();
+		Fn->setDoesNotThrow();
+	}
+
+	IRBuilder<> IRB(insertBefore);
+	Value *bounds = IRB.CreateCall(BoundsFn, {IRB.CreatePointerCast(basePtr, getInt8PtrTy(F))});
+	Value *start = IRB.CreateExtractValue(bounds, 0);
+	return {start, IRB.CreateGEP(start, IRB.CreateExtractValue(bounds, 1))};
+}
+
+/*
+ * the size of the object a check's base points into when it is known
+ * without asking the heap: allocas, globals and SizeFromType bases
+ */
+Value* getKnownObjectSize(Function &F, MemCheck &check){
+
+	const DataLayout &DL = F.getParent()->getDataLayout();
+
+	if(auto *AI = dyn_cast<AllocaInst>(check.Base)){
+		if(IsAllocaInstVLA(AI, DL))
+			return IRBuilder<>(AI).CreateMul(AI->getOperand(0),
+								getConstantInt(F, DL.getTypeAllocSize(AI->getAllocatedType())));
+		return getConstantInt(F, *AI->getAllocationSizeInBits(DL) / 8);
+	}
+
+	if(check.SizeFromType)
+		return getConstantInt(F, DL.getTypeAllocSize(check.Base->getType()->getPointerElementType()));
+
+	if(auto *GV = dyn_cast<GlobalVariable>(check.Base))
+		return getConstantInt(F, DL.getTypeAllocSize(GV->getValueType()));
+
+	return NULL;
+}
+
+/*
+ * a loop whose checks can move to its preheader: one without inner loops,
+ * left only from its latch, so that every iteration reaches the latch, and
+ * without calls, which could observe that the check failed early
+ */
+bool canHoistFromLoop(Loop *L, std::set<BasicBlock*> &blocksWithEscapeChecks){
+
+	if(not L->empty() or not L->getLoopPreheader() or not L->getLoopLatch()
+			or L->getExitingBlock() != L->getLoopLatch())
+		return false;
+
+	for(BasicBlock *BB : L->blocks()){
+		if(blocksWithEscapeChecks.count(BB))
+			return false;
+		for(Instruction &I : *BB)
+			if(isa<CallInst>(I) and not isa<IntrinsicInst>(I))
+				return false;
+	}
+	return true;
+}
+
+/*
+ * the number of leading iterations of L in which the access of a check to
+ * root + {start,+,step} stays in bounds; once an access leaves its object
+ * moving in the direction of step, it does not come back
+ */
+Value* getSafeIterations(Function &F, MemCheck &check, Value *start, int64_t step, Instruction *insertBefore){
+
+	ObjectBounds bounds;
+	if(Value *bytesAllocated = getKnownObjectSize(F, check))
+		bounds = getKnownBounds(F, check.Base, bytesAllocated, insertBefore);
+	else
+		bounds = getHeapBounds(F, check.Base, insertBefore);
+
+	IRBuilder<> IRB(insertBefore);
+	Value *root = IRB.CreatePointerCast(start, getInt8PtrTy(F));
+	Value *ptr = IRB.CreateGEP(root, getConstantInt(F, check.Lo));
+	Value *ptrEnd = IRB.CreateGEP(root, getConstantInt(F, check.Hi));
+	Value *inBounds = IRB.CreateAnd(IRB.CreateICmpUGE(ptr, bounds.Start), IRB.CreateICmpULE(ptrEnd, bounds.End));
+
+	Value *room = step > 0 ? IRB.CreateSub(IRB.CreatePtrToInt(bounds.End, getInt64Ty(F)),
+											IRB.CreatePtrToInt(ptrEnd, getInt64Ty(F)))
+							: IRB.CreateSub(IRB.CreatePtrToInt(ptr, getInt64Ty(F)),
+											IRB.CreatePtrToInt(bounds.Start, getInt64Ty(F)));
+	Value *iterations = IRB.CreateAdd(IRB.CreateUDiv(room, getConstantInt(F, step > 0 ? step : -step)),
+										getConstantInt(F, 1));
+	return IRB.CreateSelect(inBounds, iterations, getConstantInt(F, 0));
+}
+
+/*
+ * runs the first safeIterations iterations of L in a copy without the
+ * versioned checks, then continues in L itself, which keeps all of its
+ * checks; the other checks of L are copied into clonedChecks
+ */
+void versionLoop(Function &F, Loop *L, Value *safeIterations, std::set<MemCheck*> &versioned,
+					std::vector<MemCheck> &checks, std::vector<MemCheck> &clonedChecks){
+
+	BasicBlock *preheader = L->getLoopPreheader();
+	BasicBlock *header = L->getHeader();
+	BasicBlock *latch = L->getLoopLatch();
+
+	ValueToValueMapTy VMap;
+	SmallVector<BasicBlock*, 8> fastBlocks;
+	for(BasicBlock *BB : L->blocks()){
+		BasicBlock *fastBB = CloneBasicBlock(BB, VMap, ".fast", &F);
+		VMap[BB] = fastBB;
+		fastBlocks.push_back(fastBB);
+	}
+	remapInstructionsInBlocks(fastBlocks, VMap);
+
+	auto mapValue = [&](Value *V) -> Value* {
+		auto It = VMap.find(V);
+		return It == VMap.end() ? V : (Value*)It->second;
+	};
+
+	// the copy leaves L through the same exits
+	SmallVector<BasicBlock*, 4> exits;
+	L->getUniqueExitBlocks(exits);
+	for(BasicBlock *exit : exits)
+		for(PHINode &PN : exit->phis())
+			for(unsigned i = 0, e = PN.getNumIncomingValues(); i != e; i++)
+				if(L->contains(PN.getIncomingBlock(i)))
+					PN.addIncoming(mapValue(PN.getIncomingValue(i)), cast<BasicBlock>(VMap[PN.getIncomingBlock(i)]));
+
+	// count the iterations of the copy, and continue in L after the last safe one
+	BasicBlock *fastHeader = cast<BasicBlock>(VMap[header]);
+	BasicBlock *fastLatch = cast<BasicBlock>(VMap[latch]);
+	BasicBlock *fastNext = BasicBlock::Create(F.getContext(), "memsafe.fast.next", &F);
+	BasicBlock *fastExit = BasicBlock::Create(F.getContext(), "memsafe.fast.exit", &F);
+
+	fastLatch->getTerminator()->replaceUsesOfWith(fastHeader, fastNext);
+	for(PHINode &PN : fastHeader->phis())
+		for(unsigned i = 0, e = PN.getNumIncomingValues(); i != e; i++)
+			if(PN.getIncomingBlock(i) == fastLatch)
+				PN.setIncomingBlock(i, fastNext);
+
+	PHINode *iteration = PHINode::Create(getInt64Ty(F), 2, "memsafe.iteration", &fastHeader->front());
+	IRBuilder<> IRB(fastNext);
+	Value *nextIteration = IRB.CreateAdd(iteration, getConstantInt(F, 1));
+	IRB.CreateCondBr(IRB.CreateICmpULT(nextIteration, safeIterations), fastHeader, fastExit);
+	iteration->addIncoming(getConstantInt(F, 0), preheader);
+	iteration->addIncoming(nextIteration, fastNext);
+
+	BranchInst::Create(header, fastExit);
+	for(PHINode &PN : header->phis())
+		PN.addIncoming(mapValue(PN.getIncomingValueForBlock(latch)), fastExit);
+
+	Instruction *preheaderBr = preheader->getTerminator();
+	IRBuilder<>(preheaderBr).CreateCondBr(IRBuilder<>(preheaderBr).CreateICmpNE(safeIterations, getConstantInt(F, 0)),
+											fastHeader, header);
+	preheaderBr->eraseFromParent();
+
+	// L keeps a preheader, where addBoundsCheck looks up the bounds of its heap objects
+	SplitBlockPredecessors(header, {preheader, fastExit}, ".checked");
+
+	// values of L used after it now come from either loop
+	std::set<BasicBlock*> fastSet(fastBlocks.begin(), fastBlocks.end());
+	for(BasicBlock *BB : L->blocks())
+		for(Instruction &I : *BB){
+
+			SmallVector<Use*, 8> usesAfterLoop;
+			for(Use &U : I.uses()){
+				BasicBlock *useBlock = cast<Instruction>(U.getUser())->getParent();
+				if(auto *PN = dyn_cast<PHINode>(U.getUser()))
+					useBlock = PN->getIncomingBlock(U);
+				if(not L->contains(useBlock) and not fastSet.count(useBlock))
+					usesAfterLoop.push_back(&U);
+			}
+			if(usesAfterLoop.empty())
+				continue;
+
+			SSAUpdater SSA;
+			SSA.Initialize(I.getType(), I.getName());
+			SSA.AddAvailableValue(BB, &I);
+			SSA.AddAvailableValue(cast<BasicBlock>(VMap[BB]), VMap[&I]);
+			for(Use *U : usesAfterLoop)
+				SSA.RewriteUse(*U);
+		}
+
+	for(auto &check: checks)
+		if(L->contains(check.At->getParent()) and not versioned.count(&check)){
+			MemCheck fastCheck = check;
+			fastCheck.At = cast<Instruction>(VMap[check.At]);
+			fastCheck.Base = mapValue(check.Base);
+			fastCheck.Ptr = mapValue(check.Ptr);
+			fastCheck.Root = mapValue(check.Root);
+			clonedChecks.push_back(fastCheck);
+		}
+	NumLoopsVersioned++;
+}
+
+/*
+ * replaces the check of an access to root + {start,+,step} in a loop by a
+ * check of the first and last iteration in the preheader, like
+ * InductiveRangeCheckElimination; when the trip count is unknown, the loop
+ * is versioned instead, see versionLoop. Returns whether the CFG changed.
+ */
+bool hoistLoopChecks(Function &F, std::vector<MemCheck> &checks, DominatorTree &DT, LoopInfo &LI,
+						ScalarEvolution &SE){
+
+	std::set<BasicBlock*> blocksWithEscapeChecks;
+	for(auto &check: checks)
+		if(check.IsEscape and not check.Eliminated)
+			blocksWithEscapeChecks.insert(check.At->getParent());
+
+	std::map<Loop*, bool> hoistable;
+	SCEVExpander expander(SE, F.getParent()->getDataLayout(), "memsafe.range");
+
+	// loops to version -> the iterations their copy may run, and the checks it drops
+	std::map<Loop*, Value*> safeIterationsOfLoop;
+	std::map<Loop*, std::set<MemCheck*>> versionedChecksOfLoop;
+
+	for(auto &check: checks){
+
+		if(check.IsEscape or check.Eliminated)
+			continue;
+
+		Loop *L = LI.getLoopFor(check.At->getParent());
+		if(not L or not L->empty() or not L->getLoopPreheader() or not L->getLoopLatch()
+				or not L->isLoopInvariant(check.Base))
+			continue;
+
+		auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(check.Root));
+		if(not AR or AR->getLoop() != L or not AR->isAffine())
+			continue;
+
+		auto *step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+		if(not step or step->getValue()->isZero() or not isSafeToExpand(AR->getStart(), SE))
+			continue;
+
+		Instruction *insertBefore = L->getLoopPreheader()->getTerminator();
+		const SCEV *backedges = SE.getBackedgeTakenCount(L);
+
+		if(isa<SCEVCouldNotCompute>(backedges)){
+			Value *start = expander.expandCodeFor(AR->getStart(), AR->getType(), insertBefore);
+			Value *safeIterations = getSafeIterations(F, check, start, step->getAPInt().getSExtValue(), insertBefore);
+			if(safeIterationsOfLoop.count(L)){
+				IRBuilder<> IRB(insertBefore);
+				Value *fewer = IRB.CreateICmpULT(safeIterations, safeIterationsOfLoop[L]);
+				safeIterations = IRB.CreateSelect(fewer, safeIterations, safeIterationsOfLoop[L]);
+			}
+			safeIterationsOfLoop[L] = safeIterations;
+			versionedChecksOfLoop[L].insert(&check);
+			continue;
 		}
+
+		if(not hoistable.count(L))
+			hoistable[L] = canHoistFromLoop(L, blocksWithEscapeChecks);
+		if(not hoistable[L] or not DT.dominates(check.At->getParent(), L->getLoopLatch()))
+			continue;
+
+		const SCEV *last = AR->evaluateAtIteration(backedges, SE);
+		if(not isSafeToExpand(last, SE))
+			continue;
+
+		check.Root = expander.expandCodeFor(AR->getStart(), AR->getType(), insertBefore);
+		check.Last = expander.expandCodeFor(last, AR->getType(), insertBefore);
+		check.Iterations = expander.expandCodeFor(backedges, backedges->getType(), insertBefore);
+		check.Stride = step->getAPInt().abs().getZExtValue();
+		check.At = insertBefore;
+		NumChecksHoisted++;
+	}
+
+	// the CFG changes only now, after all SCEV queries
+	std::vector<MemCheck> clonedChecks;
+	for(auto &L_Iterations: safeIterationsOfLoop)
+		versionLoop(F, L_Iterations.first, L_Iterations.second, versionedChecksOfLoop[L_Iterations.first],
+					checks, clonedChecks);
+	checks.insert(checks.end(), clonedChecks.begin(), clonedChecks.end());
+	return not safeIterationsOfLoop.empty();
+}
+
+void insertCheckForOutOfBoundPointer(Function &F, std::vector<MemCheck> &checks){
+	
+	for(auto &check: checks){
+
+		if(not check.IsEscape or check.Eliminated)
+			continue;
+
+		Instruction *insertBefore = check.At;
+		Value *basePtr = insertBitCastIfNeeded(F, check.Base, insertBefore);	// convert baseptr to i8*
+		Value *ptr = insertBitCastIfNeeded(F, check.Ptr, insertBefore);
+
+		auto fnEscape = F.getParent()->getOrInsertFunction("IsSafeToEscape", getVoidTy(F), getInt8PtrTy(F), getInt8PtrTy(F));
+		CallInst::Create(fnEscape, {basePtr, ptr}, "", insertBefore);
+		NumEscapeChecks++;
+	}
+}
+
+/*
+ * where the bounds of a heap object are looked up: the nearest common
+ * dominator of its accesses, hoisted out of the loops the base pointer
+ * is defined outside of
+ */
+Instruction* getBoundsInsertPoint(Value *basePtr, std::vector<Instruction*> &accesses,
+									DominatorTree &DT, LoopInfo &LI){
+
+	BasicBlock *block = accesses[0]->getParent();
+	for(auto *access: accesses)
+		block = DT.findNearestCommonDominator(block, access->getParent());
+
+	BasicBlock *defBlock = NULL;
+	if(auto *I = dyn_cast<Instruction>(basePtr))
+		defBlock = I->getParent();
+
+	Loop *L = LI.getLoopFor(block);
+	while(L and not (defBlock and L->contains(defBlock)) and L->getLoopPreheader()){
+		block = L->getLoopPreheader();
+		L = LI.getLoopFor(block);
+	}
+
+	// before the first access in the block, or at its end
+	std::set<Instruction*> accessSet(accesses.begin(), accesses.end());
+	for(Instruction &I : *block)
+		if(accessSet.count(&I))
+			return &I;
+	return block->getTerminator();
+}
+
+// one cold block per function reports all failed checks
+BasicBlock* getBoundsFailBlock(Function &F, BasicBlock *&failBlock){
+
+	if(failBlock)
+		return failBlock;
+
+	auto FailFn = F.getParent()->getOrInsertFunction("BoundsCheckFailed", getVoidTy(F));
+	if(auto *Fn = dyn_cast<Function>(FailFn.getCallee())){
+		Fn->setDoesNotReturn();
+		Fn->addFnAttr(Attribute::Cold);
+	}
+
+	failBlock = BasicBlock::Create(F.getContext(), "bounds.fail", &F);
+	CallInst::Create(FailFn, "", failBlock);
+	new UnreachableInst(F.getContext(), failBlock);
+	return failBlock;
+}
+
+/*
+ * the bounds of each base pointer are materialized once: a constant size
+ * for allocas and globals, a GetObjectBounds() call for heap objects; each
+ * access then compares against them inline and branches to a cold block
+ * that reports the failure
+ */
+void addBoundsCheck(Function &F, std::vector<MemCheck> &checks, DominatorTree &DT, LoopInfo &LI){
+
+	// base pointer -> accesses through it, and the size of the base when it is known statically
+	std::map<Value*, std::vector<Instruction*>> accessesOfBase;
+	std::map<Value*, Value*> bytesAllocatedOfBase;
+
+	for(auto &check: checks){
+
+		if(check.IsEscape or check.Eliminated)
+			continue;
+
+		Value *basePtr = check.Base;
+		accessesOfBase[basePtr].push_back(check.At);
+		if(bytesAllocatedOfBase.count(basePtr))
+			continue;
+
+		if(Value *bytesAllocated = getKnownObjectSize(F, check))
+			bytesAllocatedOfBase[basePtr] = bytesAllocated;
+	}
+
+	// materialize the bounds of every base before the CFG changes
+	std::map<Value*, ObjectBounds> boundsOfBase;
+
+	for(auto &base_Accesses: accessesOfBase){
+
+		Value *basePtr = base_Accesses.first;
+
+		if(bytesAllocatedOfBase.count(basePtr)){
+			Instruction *insertBefore = &*F.getEntryBlock().getFirstInsertionPt();
+			if(auto *AI = dyn_cast<AllocaInst>(basePtr))
+				insertBefore = AI->getNextNode();
+			boundsOfBase[basePtr] = getKnownBounds(F, basePtr, bytesAllocatedOfBase[basePtr], insertBefore);
+		}
+		else
+			boundsOfBase[basePtr] = getHeapBounds(F, basePtr, getBoundsInsertPoint(basePtr, base_Accesses.second, DT, LI));
+	}
+
+	BasicBlock *failBlock = NULL;
+	MDNode *coldWeights = MDBuilder(F.getContext()).createBranchWeights(1, 1 << 20);
+
+	for(auto &check: checks){
+
+		if(check.IsEscape or check.Eliminated)
+			continue;
+
+		Instruction *access = check.At;
+		ObjectBounds &bounds = boundsOfBase[check.Base];
+
+		// a merged check covers [Root + Lo, Root + Hi)
+		IRBuilder<> IRB(access);
+		Value *root = IRB.CreatePointerCast(check.Root, getInt8PtrTy(F));
+		Value *ptr = IRB.CreateGEP(root, getConstantInt(F, check.Lo));
+		Value *ptrEnd = IRB.CreateGEP(root, getConstantInt(F, check.Hi));
+		Value *outOfBounds = IRB.CreateOr(IRB.CreateICmpULT(ptr, bounds.Start),
+											IRB.CreateICmpUGT(ptrEnd, bounds.End));
+
+		if(check.Last){
+			// with both ends in bounds, the accesses in between are too unless the range wraps
+			Value *last = IRB.CreatePointerCast(check.Last, getInt8PtrTy(F));
+			Value *lastPtr = IRB.CreateGEP(last, getConstantInt(F, check.Lo));
+			Value *lastEnd = IRB.CreateGEP(last, getConstantInt(F, check.Hi));
+			Value *span = IRB.CreateSub(IRB.CreatePtrToInt(bounds.End, getInt64Ty(F)),
+										IRB.CreatePtrToInt(bounds.Start, getInt64Ty(F)));
+			Value *wraps = IRB.CreateICmpUGT(IRB.CreateZExtOrTrunc(check.Iterations, getInt64Ty(F)),
+											IRB.CreateUDiv(span, getConstantInt(F, check.Stride)));
+			outOfBounds = IRB.CreateOr(outOfBounds, IRB.CreateOr(IRB.CreateICmpULT(lastPtr, bounds.Start),
+											IRB.CreateOr(IRB.CreateICmpUGT(lastEnd, bounds.End), wraps)));
+		}
+
+		BasicBlock *head = access->getParent();
+		BasicBlock *tail = head->splitBasicBlock(access);
+		head->getTerminator()->eraseFromParent();
+		BranchInst::Create(getBoundsFailBlock(F, failBlock), tail, outOfBounds, head)->setMetadata(LLVMContext::MD_prof, coldWeights);
+		NumBoundsChecks++;
 	}
 }
 
@@ -324,12 +1119,18 @@ unsigned long long computeBitMap(const DataLayout &DL, Type *Ty)
 		}
 	}
 
+	auto Sz = DL.getTypeAllocSize(Ty);
 	if (bitmap) {
-		auto Sz = DL.getTypeAllocSize(Ty);
 		assert((Sz & 7) == 0 && "type is not aligned!");
-		bitpos++;
-		bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
+		/* the pattern repeats every Sz bytes, trailing non-pointer fields included */
+		bitpos = Sz / 8;
+		assert(bitpos < 64 && "can not handle more than 63 fields!");
+	}
+	else {
+		/* a type without pointers is only its terminator, as in TypeAssigner */
+		bitpos = std::min<uint64_t>(Sz / 8, 63);
 	}
+	bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
 	return bitmap;
 }
 
@@ -387,6 +1188,15 @@ void addWriteBarrierCheck(Function &F, const TargetLibraryInfo *TLI){
 		else
 			accessSize = DL.getTypeAllocSize(ptr_Inst.second->getType());
 
+		// snapshot-at-the-beginning: the overwritten value is logged before the store
+		if(SATBBarrier){
+			auto *store = cast<Instruction>(ptr_Inst.second);
+			auto PreWriteFn = F.getParent()->getOrInsertFunction("GCPreWrite", getVoidTy(F),
+																getInt8PtrTy(F), getInt64Ty(F));
+			CallInst::Create(PreWriteFn, {insertBitCastIfNeeded(F, ptr_Inst.first, store),
+						getConstantInt(F, accessSize)}, "", store);
+		}
+
 		if(needWriteBarrierWithSize){
 			auto WriteBarrierFn = F.getParent()->getOrInsertFunction("WriteBarrierWithSize", getVoidTy(F),
 															getInt8PtrTy(F), getInt8PtrTy(F), 
@@ -405,9 +1215,23 @@ void addWriteBarrierCheck(Function &F, const TargetLibraryInfo *TLI){
 
 bool MemSafe::runOnFunction(Function &F) {
 	TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+	DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+	LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
 	convertAllocaToMyMalloc(F, TLI);
-	insertCheckForOutOfBoundPointer(F, TLI);
-	addBoundsCheck(F, TLI);
+	if(HoistLoopChecks)
+		promoteIntegerLocals(F, DT);
+	std::vector<MemCheck> checks = collectChecks(F, TLI);
+	removeStaticallySafeChecks(F, checks, TLI);
+	if(EliminateChecks)
+		eliminateRedundantChecks(F, checks, DT);
+	if(HoistLoopChecks)
+		if(hoistLoopChecks(F, checks, DT, LI, getAnalysis<ScalarEvolutionWrapperPass>().getSE())){
+			DT.recalculate(F);
+			LI.releaseMemory();
+			LI.analyze(DT);
+		}
+	insertCheckForOutOfBoundPointer(F, checks);
+	addBoundsCheck(F, checks, DT, LI);
 	addWriteBarrierCheck(F, TLI);
 	return true;
 }
@@ -0,0 +1,282 @@
+#include "llvm/Pass.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Value.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "safegc-statepoints"
+
+STATISTIC(NumStatepoints, "Number of calls rewritten as statepoints");
+STATISTIC(NumSkippedCalls, "Number of calls that may collect but could not be rewritten");
+
+/*
+ * SafeGC scans the stack of the collecting thread precisely when every frame
+ * on it stopped at a statepoint (SAFEGC_PRECISE_STACK=1, see stackmap.c).
+ * Every call that may reach the collector is rewritten as a gc.statepoint
+ * whose deopt operands are (size, value) pairs: (0, p) for each pointer live
+ * across the call and (n, a) for each alloca a of n bytes that may hold one.
+ * SafeGC does not move objects referenced from the stack, so the values are
+ * not relocated; the statepoint only makes codegen spill them to slots the
+ * stack map describes. Rewritten functions keep their frame pointer, which
+ * the runtime follows from frame to frame.
+ */
+static cl::opt<bool> UseStatepoints("memsafe-statepoints",
+	cl::desc("Emit stack maps for SafeGC's precise stack scanning"),
+	cl::init(false));
+
+/* must match SAFEGC_STATEPOINT_ID in support/SafeGC/memory.h */
+static const uint64_t SafeGCStatepointID = 0x5afe6c00;
+
+namespace {
+struct SafeGCStatepoints : public FunctionPass {
+  static char ID;
+	const TargetLibraryInfo *TLI = nullptr;
+  SafeGCStatepoints() : FunctionPass(ID) {}
+
+	void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F) override;
+
+}; // end of struct SafeGCStatepoints
+}  // end of anonymous namespace
+
+/* SafeGC entry points and instrumentation that never start a collection */
+static bool isNonCollectingRuntimeCall(StringRef Name)
+{
+	return Name == "myfree" || Name == "BoundsCheck" || Name == "BoundsCheckWithSize" ||
+		Name == "IsSafeToEscape" || Name == "WriteBarrier" || Name == "WriteBarrierWithSize" ||
+		Name == "GCRecordWrite" || Name == "GCPreWrite" || Name == "SetType" || Name == "GetType" ||
+		Name == "GetSize" || Name == "mycast" || Name == "checkTypeInv" || Name == "checkSizeInv" ||
+		Name == "checkSizeAndTypeInv" || Name == "readArgv" || Name == "GetObjectBounds" ||
+		Name == "BoundsCheckFailed";
+}
+
+static bool mayCollect(CallInst *CI, const TargetLibraryInfo *TLI)
+{
+	if (isa<IntrinsicInst>(CI) || CI->isInlineAsm())
+		return false;
+
+	auto *Callee = CI->getCalledFunction();
+	if (Callee) {
+		LibFunc Func;
+		if (TLI->getLibFunc(*Callee, Func) || isNonCollectingRuntimeCall(Callee->getName()))
+			return false;
+	}
+	/* mymalloc, runGC and dumpHeap, the program's own functions and indirect calls */
+	return true;
+}
+
+/* varargs calls and operand bundles can not be wrapped in a statepoint */
+static bool canRewrite(CallInst *CI)
+{
+	return !CI->getFunctionType()->isVarArg() && !CI->hasOperandBundles() && !CI->isMustTailCall();
+}
+
+/* values that may be a pointer into the heap at run time */
+static bool isTracked(Value *V)
+{
+	if (isa<AllocaInst>(V))
+		return false;
+	if (!isa<Instruction>(V) && !isa<Argument>(V))
+		return false;
+	return V->getType()->isPointerTy() || isa<PtrToIntInst>(V);
+}
+
+static bool mayHoldPointer(Type *Ty)
+{
+	if (Ty->isPointerTy())
+		return true;
+	if (Ty->isIntegerTy())
+		return Ty->getIntegerBitWidth() >= 64;
+	if (auto *STy = dyn_cast<StructType>(Ty)) {
+		for (auto *ElemTy : STy->elements())
+			if (mayHoldPointer(ElemTy))
+				return true;
+		return false;
+	}
+	if (Ty->isArrayTy() || Ty->isVectorTy())
+		return mayHoldPointer(Ty->getSequentialElementType());
+	return false;
+}
+
+typedef SetVector<Value*> LiveSet;
+
+/* removes I's definition from Live and adds the tracked values it uses; phi uses belong to the edges */
+static void stepBackward(Instruction &I, LiveSet &Live)
+{
+	Live.remove(&I);
+	if (isa<PHINode>(I))
+		return;
+	for (Value *Op : I.operands())
+		if (isTracked(Op))
+			Live.insert(Op);
+}
+
+static void computeLiveOut(Function &F, std::map<BasicBlock*, LiveSet> &LiveOut)
+{
+	std::map<BasicBlock*, LiveSet> LiveIn;
+	bool Changed = true;
+
+	while (Changed) {
+		Changed = false;
+		for (BasicBlock &BB : F) {
+			LiveSet Out;
+			for (BasicBlock *Succ : successors(&BB)) {
+				for (Value *V : LiveIn[Succ])
+					Out.insert(V);
+				for (PHINode &Phi : Succ->phis()) {
+					Value *Incoming = Phi.getIncomingValueForBlock(&BB);
+					if (isTracked(Incoming))
+						Out.insert(Incoming);
+				}
+			}
+
+			LiveSet In = Out;
+			for (auto I = BB.rbegin(); I != BB.rend(); ++I)
+				stepBackward(*I, In);
+
+			if (Out.size() != LiveOut[&BB].size() || In.size() != LiveIn[&BB].size()) {
+				LiveOut[&BB] = Out;
+				LiveIn[&BB] = In;
+				Changed = true;
+			}
+		}
+	}
+}
+
+static void rewriteAsStatepoint(CallInst *CI, ArrayRef<Value*> DeoptArgs)
+{
+	IRBuilder<> Builder(CI);
+	std::vector<Value*> CallArgs(CI->arg_begin(), CI->arg_end());
+
+	CallInst *Token = Builder.CreateGCStatepointCall(SafeGCStatepointID, 0, CI->getCalledValue(),
+															CallArgs, DeoptArgs, None);
+	Token->setCallingConv(CI->getCallingConv());
+	Token->setDebugLoc(CI->getDebugLoc());
+
+	/* the call arguments of a statepoint start at operand 5; keep sext/zext, byval and the like */
+	AttributeList Attrs = CI->getAttributes();
+	for (unsigned i = 0; i < CallArgs.size(); i++) {
+		AttributeSet ArgAttrs = Attrs.getParamAttributes(i);
+		if (ArgAttrs.hasAttributes())
+			Token->setAttributes(Token->getAttributes().addParamAttributes(CI->getContext(), 5 + i,
+																			AttrBuilder(ArgAttrs)));
+	}
+
+	if (!CI->getType()->isVoidTy()) {
+		Value *Result = Builder.CreateGCResult(Token, CI->getType(), CI->getName());
+		CI->replaceAllUsesWith(Result);
+	}
+	CI->eraseFromParent();
+}
+
+bool SafeGCStatepoints::runOnFunction(Function &F) {
+	TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+	DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+	const DataLayout &DL = F.getParent()->getDataLayout();
+
+	std::map<BasicBlock*, LiveSet> LiveOut;
+	computeLiveOut(F, LiveOut);
+
+	std::vector<AllocaInst*> Allocas;
+	for (Instruction &I : instructions(F))
+		if (auto *AI = dyn_cast<AllocaInst>(&I))
+			if (mayHoldPointer(AI->getAllocatedType()))
+				Allocas.push_back(AI);
+
+	// (call, pointers live across it); the handles follow the results of calls rewritten before
+	std::vector<std::pair<CallInst*, std::vector<WeakTrackingVH>>> CallsToRewrite;
+
+	for (BasicBlock &BB : F) {
+		LiveSet Live = LiveOut[&BB];
+		for (auto I = BB.rbegin(); I != BB.rend(); ++I) {
+			auto *CI = dyn_cast<CallInst>(&*I);
+			if (CI && mayCollect(CI, TLI)) {
+				if (canRewrite(CI)) {
+					Live.remove(CI);
+					CallsToRewrite.push_back({CI, std::vector<WeakTrackingVH>(Live.begin(), Live.end())});
+				}
+				else
+					NumSkippedCalls++;
+			}
+			stepBackward(*I, Live);
+		}
+	}
+
+	if (CallsToRewrite.empty())
+		return false;
+
+	// sizes of the allocas, computed where they are allocated
+	std::map<AllocaInst*, Value*> AllocaSizes;
+	for (auto *AI : Allocas) {
+		if (AI->isStaticAlloca()) {
+			AllocaSizes[AI] = ConstantInt::get(Type::getInt64Ty(F.getContext()), *AI->getAllocationSizeInBits(DL) / 8);
+			continue;
+		}
+		IRBuilder<> Builder(AI->getNextNode());
+		Value *Count = Builder.CreateZExtOrTrunc(AI->getArraySize(), Builder.getInt64Ty());
+		AllocaSizes[AI] = Builder.CreateMul(Count, Builder.getInt64(DL.getTypeAllocSize(AI->getAllocatedType())));
+	}
+
+	Constant *PointerSize = ConstantInt::get(Type::getInt64Ty(F.getContext()), 0);
+	for (auto &Call : CallsToRewrite) {
+		std::vector<Value*> DeoptArgs;
+		for (Value *V : Call.second) {
+			if (!V)
+				continue;
+			DeoptArgs.push_back(PointerSize);
+			DeoptArgs.push_back(V);
+		}
+		for (auto *AI : Allocas) {
+			if (!DT.dominates(AI, Call.first))
+				continue;
+			DeoptArgs.push_back(AllocaSizes[AI]);
+			DeoptArgs.push_back(AI);
+		}
+		rewriteAsStatepoint(Call.first, DeoptArgs);
+		NumStatepoints++;
+	}
+
+	F.setGC("statepoint-example");
+	F.removeFnAttr("frame-pointer");
+	F.addFnAttr("frame-pointer", "all");
+	return true;
+}
+
+char SafeGCStatepoints::ID = 0;
+static RegisterPass<SafeGCStatepoints> X("safegc-statepoints", "Statepoints for SafeGC's precise stack scanning",
+                               false /* Only looks at CFG */,
+                               false /* Analysis Pass */);
+
+/* after the optimizations, which statepoints would get in the way of */
+static RegisterStandardPasses Y(
+    PassManagerBuilder::EP_OptimizerLast,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) { if (UseStatepoints) PM.add(new SafeGCStatepoints()); });
+
+static RegisterStandardPasses Z(
+    PassManagerBuilder::EP_EnabledOnOptLevel0,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) { if (UseStatepoints) PM.add(new SafeGCStatepoints()); });
@@ -51,13 +51,20 @@ struct TypeAssigner : public FunctionPass {
 			}
 		}
 
+		auto Sz = DL.getTypeAllocSize(Ty);
 		if (bitmap)
 		{
-			auto Sz = DL.getTypeAllocSize(Ty);
 			assert((Sz & 7) == 0 && "type is not aligned!");
-			bitpos++;
-			bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
+			/* the pattern repeats every Sz bytes, trailing non-pointer fields included */
+			bitpos = Sz / 8;
+			assert(bitpos < 64 && "can not handle more than 63 fields!");
 		}
+		else
+		{
+			/* a type without pointers is only its terminator; the period of an empty pattern does not matter */
+			bitpos = std::min<uint64_t>(Sz / 8, 63);
+		}
+		bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
 		return bitmap;
 	}
 
@@ -52,13 +52,20 @@ struct TypeChecker : public FunctionPass {
 			}
 		}
 
+		auto Sz = DL.getTypeAllocSize(Ty);
 		if (bitmap)
 		{
-			auto Sz = DL.getTypeAllocSize(Ty);
 			assert((Sz & 7) == 0 && "type is not aligned!");
-			bitpos++;
-			bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
+			/* the pattern repeats every Sz bytes, trailing non-pointer fields included */
+			bitpos = Sz / 8;
+			assert(bitpos < 64 && "can not handle more than 63 fields!");
 		}
+		else
+		{
+			/* a type without pointers is only its terminator; the period of an empty pattern does not matter */
+			bitpos = std::min<uint64_t>(Sz / 8, 63);
+		}
+		bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
 		return bitmap;
 	}
 
@@ -89,13 +96,20 @@ struct TypeChecker : public FunctionPass {
 	}
 
 
+	// only the terminator is set: the type has no pointer fields
+	bool isPointerFree(u64 bitMap) {
+		return (bitMap & (bitMap - 1)) == 0;
+	}
+
 	// 1 means always
 	// 0 means do not hold
 	// 2 means need runtime check
 	int checkTypeVar(u64 srcBitmap, u64 dstBitmap) {
 		if (srcBitmap == dstBitmap)
 			return 1;
-		else if (srcBitmap == 0 || dstBitmap == 0)	// exactly one of them contains pointer field 
+		else if (isPointerFree(srcBitmap) && isPointerFree(dstBitmap))	// neither contains a pointer field
+			return 1;
+		else if (isPointerFree(srcBitmap) || isPointerFree(dstBitmap))	// exactly one of them contains pointer field
 			return 0;
 
 		unsigned srcNumFields = getNumFields(srcBitmap);
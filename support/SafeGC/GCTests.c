@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+#define NUM_OBJECTS 1000
+#define OBJECT_SIZE 64
+#define BIG_OBJECTS 16
+#define BIG_OBJECT_SIZE (64 * 1024)
+
+static char *Objects[NUM_OBJECTS];
+static int NumFailed = 0;
+
+static void check(int Cond, const char *Name)
+{
+	printf("%s: %s\n", Name, Cond ? "ok" : "FAILED");
+	if (!Cond)
+	{
+		NumFailed++;
+	}
+}
+
+static int isZero(const char *Obj, size_t Size)
+{
+	size_t Iter;
+
+	for (Iter = 0; Iter < Size; Iter++)
+	{
+		if (Obj[Iter])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* memory reused from a swept hole is handed out zeroed, like fresh memory */
+static void testReusedHolesAreZeroed()
+{
+	int Iter, NumDirty = 0;
+
+	for (Iter = 0; Iter < NUM_OBJECTS; Iter++)
+	{
+		Objects[Iter] = mymalloc(OBJECT_SIZE);
+		memset(Objects[Iter], 0xAB, OBJECT_SIZE);
+	}
+	for (Iter = 0; Iter < NUM_OBJECTS; Iter += 2)
+	{
+		myfree(Objects[Iter]);
+		Objects[Iter] = NULL;
+	}
+	runGC();
+	for (Iter = 0; Iter < NUM_OBJECTS; Iter++)
+	{
+		if (!isZero(mymalloc(OBJECT_SIZE), OBJECT_SIZE))
+		{
+			NumDirty++;
+		}
+	}
+	check(NumDirty == 0, "reused holes are zeroed");
+	memset(Objects, 0, sizeof(Objects));
+	runGC();
+}
+
+/* a freed big object's pages are handed out zeroed, whatever decommitting left in them */
+static void testReusedBigExtentsAreZeroed()
+{
+	int Iter, NumDirty = 0;
+
+	for (Iter = 0; Iter < BIG_OBJECTS; Iter++)
+	{
+		Objects[Iter] = mymalloc(BIG_OBJECT_SIZE);
+		memset(Objects[Iter], 0xAB, BIG_OBJECT_SIZE);
+	}
+	for (Iter = 0; Iter < BIG_OBJECTS; Iter++)
+	{
+		myfree(Objects[Iter]);
+		Objects[Iter] = NULL;
+	}
+	runGC();
+	for (Iter = 0; Iter < BIG_OBJECTS; Iter++)
+	{
+		Objects[Iter] = mymalloc(BIG_OBJECT_SIZE);
+		if (!isZero(Objects[Iter], BIG_OBJECT_SIZE))
+		{
+			NumDirty++;
+		}
+	}
+	check(NumDirty == 0, "reused big extents are zeroed");
+	memset(Objects, 0, sizeof(Objects));
+	runGC();
+}
+
+/* an int array is typed pointer-free, so values in it that look like heap addresses keep nothing alive */
+static void testPointerFreeObjectsAreNotScanned()
+{
+	int Iter;
+	int *Ints = mymalloc(NUM_OBJECTS * sizeof(char*));
+	GCStats Stats;
+
+	SetType(Ints, 1ULL << (sizeof(int) / 8));
+	for (Iter = 0; Iter < NUM_OBJECTS; Iter++)
+	{
+		char *Target = mymalloc(OBJECT_SIZE);
+		memcpy(&Ints[Iter * 2], &Target, sizeof(Target));
+	}
+	Objects[0] = (char*)Ints;
+	runGC();
+	GCGetStats(&Stats);
+	check(Stats.LiveBytes < NUM_OBJECTS * OBJECT_SIZE / 2, "pointer-free objects are not scanned");
+	Objects[0] = NULL;
+	runGC();
+}
+
+int main()
+{
+	testReusedHolesAreZeroed();
+	testReusedBigExtentsAreZeroed();
+	testPointerFreeObjectsAreNotScanned();
+	return NumFailed != 0;
+}
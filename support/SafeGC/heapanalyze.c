@@ -0,0 +1,362 @@
+/*
+ * heapanalyze: reads a snapshot written by dumpHeap() and reports which
+ * objects keep the most memory alive.
+ *
+ * usage: heapanalyze <snapshot> [count]
+ *
+ * Object X dominates Y when every path from the roots to Y passes through
+ * X; the retained size of X is the memory that would be freed along with
+ * it, i.e. the sizes of all objects it dominates. Dominators are computed
+ * with the iterative algorithm of Cooper, Harvey and Kennedy on the object
+ * graph below a virtual root that points to everything the roots refer to.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+typedef struct Node
+{
+	ulong64 Addr;
+	ulong64 Type;
+	unsigned Size;
+	unsigned NumEdges;
+	/* index of the first edge in Edges */
+	ulong64 FirstEdge;
+} Node;
+
+/* node 0 is the virtual root; objects are 1..NumNodes-1 in address order */
+static Node *Nodes;
+static ulong64 NumNodes;
+static ulong64 *Edges;
+static ulong64 NumEdges;
+
+static ulong64 *PredStart;
+static ulong64 *Preds;
+
+static ulong64 *PostOrder;
+static ulong64 *PostNum;
+static ulong64 NumReachable;
+static ulong64 *Idom;
+static ulong64 *Retained;
+
+#define UNDEFINED (~0ULL)
+
+static void readOrDie(void *Buf, size_t Size, size_t Count, FILE *File)
+{
+	if (fread(Buf, Size, Count, File) != Count)
+	{
+		printf("truncated snapshot\n");
+		exit(1);
+	}
+}
+
+static int compareNodes(const void *A, const void *B)
+{
+	ulong64 X = ((const Node*)A)->Addr;
+	ulong64 Y = ((const Node*)B)->Addr;
+	return X < Y ? -1 : X > Y;
+}
+
+static ulong64 findNode(ulong64 Addr)
+{
+	ulong64 Lo = 1, Hi = NumNodes;
+
+	while (Lo < Hi)
+	{
+		ulong64 Mid = Lo + (Hi - Lo) / 2;
+		if (Nodes[Mid].Addr < Addr)
+		{
+			Lo = Mid + 1;
+		}
+		else
+		{
+			Hi = Mid;
+		}
+	}
+	if (Lo < NumNodes && Nodes[Lo].Addr == Addr)
+	{
+		return Lo;
+	}
+	return UNDEFINED;
+}
+
+/* reads the snapshot, turning addresses into node numbers */
+static void readSnapshot(const char *Path)
+{
+	HeapDumpHeader Header;
+	ulong64 Idx, Capacity;
+	FILE *File = fopen(Path, "rb");
+
+	if (File == NULL)
+	{
+		printf("unable to open %s\n", Path);
+		exit(1);
+	}
+	readOrDie(&Header, sizeof(Header), 1, File);
+	if (Header.Magic != HEAP_DUMP_MAGIC)
+	{
+		printf("%s is not a heap snapshot\n", Path);
+		exit(1);
+	}
+
+	NumNodes = Header.NumObjects + 1;
+	Nodes = calloc(NumNodes, sizeof(Node));
+	Capacity = Header.NumRoots + NumNodes;
+	Edges = malloc(Capacity * sizeof(ulong64));
+	if (Nodes == NULL || Edges == NULL)
+	{
+		printf("out of memory\n");
+		exit(1);
+	}
+
+	/* the root edges belong to the virtual root */
+	readOrDie(Edges, sizeof(ulong64), Header.NumRoots, File);
+	Nodes[0].NumEdges = Header.NumRoots;
+	NumEdges = Header.NumRoots;
+
+	for (Idx = 1; Idx < NumNodes; Idx++)
+	{
+		HeapDumpObject Record;
+		readOrDie(&Record, sizeof(Record), 1, File);
+		if (NumEdges + Record.NumEdges > Capacity)
+		{
+			Capacity = 2 * (NumEdges + Record.NumEdges);
+			Edges = realloc(Edges, Capacity * sizeof(ulong64));
+			if (Edges == NULL)
+			{
+				printf("out of memory\n");
+				exit(1);
+			}
+		}
+		Nodes[Idx].Addr = Record.Addr;
+		Nodes[Idx].Type = Record.Type;
+		Nodes[Idx].Size = Record.Size;
+		Nodes[Idx].NumEdges = Record.NumEdges;
+		Nodes[Idx].FirstEdge = NumEdges;
+		readOrDie(Edges + NumEdges, sizeof(ulong64), Record.NumEdges, File);
+		NumEdges += Record.NumEdges;
+	}
+	fclose(File);
+
+	/* objects are dumped in segment order, which need not be address order */
+	qsort(Nodes + 1, NumNodes - 1, sizeof(Node), compareNodes);
+	for (Idx = 0; Idx < NumEdges; Idx++)
+	{
+		Edges[Idx] = findNode(Edges[Idx]);
+	}
+}
+
+static void computePredecessors()
+{
+	ulong64 Idx, E;
+
+	PredStart = calloc(NumNodes + 1, sizeof(ulong64));
+	Preds = malloc((NumEdges + 1) * sizeof(ulong64));
+	for (Idx = 0; Idx < NumNodes; Idx++)
+	{
+		for (E = Nodes[Idx].FirstEdge; E < Nodes[Idx].FirstEdge + Nodes[Idx].NumEdges; E++)
+		{
+			if (Edges[E] != UNDEFINED)
+			{
+				PredStart[Edges[E] + 1]++;
+			}
+		}
+	}
+	for (Idx = 0; Idx < NumNodes; Idx++)
+	{
+		PredStart[Idx + 1] += PredStart[Idx];
+	}
+
+	ulong64 *Fill = malloc(NumNodes * sizeof(ulong64));
+	memcpy(Fill, PredStart, NumNodes * sizeof(ulong64));
+	for (Idx = 0; Idx < NumNodes; Idx++)
+	{
+		for (E = Nodes[Idx].FirstEdge; E < Nodes[Idx].FirstEdge + Nodes[Idx].NumEdges; E++)
+		{
+			if (Edges[E] != UNDEFINED)
+			{
+				Preds[Fill[Edges[E]]++] = Idx;
+			}
+		}
+	}
+	free(Fill);
+}
+
+/* depth-first search from the virtual root with an explicit stack */
+static void computePostOrder()
+{
+	ulong64 *Stack = malloc(NumNodes * sizeof(ulong64));
+	ulong64 *NextEdge = calloc(NumNodes, sizeof(ulong64));
+	ulong64 Depth = 0;
+
+	PostOrder = malloc(NumNodes * sizeof(ulong64));
+	PostNum = malloc(NumNodes * sizeof(ulong64));
+	memset(PostNum, 0xff, NumNodes * sizeof(ulong64));
+
+	/* PostNum is 0 while a node is on the stack */
+	Stack[Depth++] = 0;
+	PostNum[0] = 0;
+	while (Depth)
+	{
+		ulong64 Cur = Stack[Depth - 1];
+		if (NextEdge[Cur] < Nodes[Cur].NumEdges)
+		{
+			ulong64 Succ = Edges[Nodes[Cur].FirstEdge + NextEdge[Cur]++];
+			if (Succ != UNDEFINED && PostNum[Succ] == UNDEFINED)
+			{
+				PostNum[Succ] = 0;
+				Stack[Depth++] = Succ;
+			}
+			continue;
+		}
+		PostNum[Cur] = NumReachable;
+		PostOrder[NumReachable++] = Cur;
+		Depth--;
+	}
+	free(Stack);
+	free(NextEdge);
+}
+
+static ulong64 intersect(ulong64 A, ulong64 B)
+{
+	while (A != B)
+	{
+		while (PostNum[A] < PostNum[B])
+		{
+			A = Idom[A];
+		}
+		while (PostNum[B] < PostNum[A])
+		{
+			B = Idom[B];
+		}
+	}
+	return A;
+}
+
+static void computeDominators()
+{
+	ulong64 Idx, P;
+	int Changed = 1;
+
+	Idom = malloc(NumNodes * sizeof(ulong64));
+	memset(Idom, 0xff, NumNodes * sizeof(ulong64));
+	Idom[0] = 0;
+
+	while (Changed)
+	{
+		Changed = 0;
+		/* reverse post order, skipping the virtual root */
+		for (Idx = NumReachable - 1; Idx-- > 0;)
+		{
+			ulong64 Cur = PostOrder[Idx];
+			ulong64 NewIdom = UNDEFINED;
+			for (P = PredStart[Cur]; P < PredStart[Cur + 1]; P++)
+			{
+				ulong64 Pred = Preds[P];
+				if (Idom[Pred] == UNDEFINED)
+				{
+					continue;
+				}
+				NewIdom = (NewIdom == UNDEFINED) ? Pred : intersect(Pred, NewIdom);
+			}
+			if (NewIdom != Idom[Cur])
+			{
+				Idom[Cur] = NewIdom;
+				Changed = 1;
+			}
+		}
+	}
+
+	/* a node's dominators come after it in post order */
+	Retained = calloc(NumNodes, sizeof(ulong64));
+	for (Idx = 0; Idx < NumReachable; Idx++)
+	{
+		ulong64 Cur = PostOrder[Idx];
+		Retained[Cur] += Nodes[Cur].Size;
+		if (Cur != 0)
+		{
+			Retained[Idom[Cur]] += Retained[Cur];
+		}
+	}
+}
+
+static int compareRetained(const void *A, const void *B)
+{
+	ulong64 X = Retained[*(const ulong64*)A];
+	ulong64 Y = Retained[*(const ulong64*)B];
+	return X > Y ? -1 : X < Y;
+}
+
+static void printTopRetainers(int Count)
+{
+	ulong64 *Order = malloc(NumNodes * sizeof(ulong64));
+	ulong64 Idx, Num = 0;
+
+	for (Idx = 1; Idx < NumNodes; Idx++)
+	{
+		if (PostNum[Idx] != UNDEFINED)
+		{
+			Order[Num++] = Idx;
+		}
+	}
+	qsort(Order, Num, sizeof(ulong64), compareRetained);
+
+	printf("\nTop retainers:\n");
+	printf("%-18s %10s %14s %8s %-18s %s\n", "Object", "Size", "Retained", "Edges", "Type", "Dominator");
+	for (Idx = 0; Idx < Num && Idx < (ulong64)Count; Idx++)
+	{
+		Node *N = &Nodes[Order[Idx]];
+		ulong64 Dom = Idom[Order[Idx]];
+		printf("0x%-16llx %10u %14llu %8u 0x%-16llx ", N->Addr, N->Size, Retained[Order[Idx]], N->NumEdges, N->Type);
+		if (Dom == 0)
+		{
+			printf("roots\n");
+		}
+		else
+		{
+			printf("0x%llx\n", Nodes[Dom].Addr);
+		}
+	}
+	free(Order);
+}
+
+int main(int argc, char *argv[])
+{
+	ulong64 Idx, LiveBytes = 0, UnreachedObjects = 0, UnreachedBytes = 0;
+	int Count = 20;
+
+	if (argc < 2)
+	{
+		printf("usage: %s <snapshot> [count]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+	{
+		Count = atoi(argv[2]);
+	}
+
+	readSnapshot(argv[1]);
+	computePredecessors();
+	computePostOrder();
+	computeDominators();
+
+	for (Idx = 1; Idx < NumNodes; Idx++)
+	{
+		LiveBytes += Nodes[Idx].Size;
+		if (PostNum[Idx] == UNDEFINED)
+		{
+			UnreachedObjects++;
+			UnreachedBytes += Nodes[Idx].Size;
+		}
+	}
+	printf("Live objects: %llu\n", NumNodes - 1);
+	printf("Live bytes: %llu\n", LiveBytes);
+	printf("Root references: %u\n", Nodes[0].NumEdges);
+	printf("Edges: %llu\n", NumEdges - Nodes[0].NumEdges);
+	/* marked through unaligned words, or through references overwritten before the dump */
+	printf("Objects not reached from the recorded roots: %llu (%llu bytes)\n", UnreachedObjects, UnreachedBytes);
+
+	printTopRetainers(Count);
+	return 0;
+}
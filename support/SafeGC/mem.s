@@ -1,10 +1,22 @@
 .text
 .globl mymalloc
 .globl runGC
+.globl dumpHeap
 .extern _mymalloc
+.extern _mymallocFast
 .extern _runGC
+.extern _dumpHeap
 
 mymalloc:
+# bump the thread's allocation buffer, which can not start a collection
+	push %rdi
+	movabsq $_mymallocFast, %rax
+	call *%rax
+	pop %rdi
+	test %rax, %rax
+	jz mymallocSlow
+	ret
+mymallocSlow:
 # nuke caller-saved registers except argument(s)
 	xor %rax, %rax
 	xor %rcx, %rcx
@@ -58,3 +70,30 @@ runGC:
 	mov %rbp, %rsp
 	pop %rbp
 	ret
+
+dumpHeap:
+# like runGC, but the path in %rdi is passed on
+	xor %rax, %rax
+	xor %rcx, %rcx
+	xor %rdx, %rdx
+	xor %rsi, %rsi
+	xor %r8, %r8
+	xor %r9, %r9
+	xor %r10, %r10
+	xor %r11, %r11
+	push %rbp
+	mov %rsp, %rbp
+# move possible register roots on stack
+	push %rbx
+	push %r12
+	push %r13
+	push %r14
+	push %r15
+# put marker on stack
+	push $0x12abcdef
+	sub $16, %rsp
+	movabsq $_dumpHeap, %rax
+	call *%rax
+	mov %rbp, %rsp
+	pop %rbp
+	ret
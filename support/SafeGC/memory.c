@@ -4,10 +4,151 @@
 
 long long NumGCTriggered = 0;
 long long NumBytesFreed = 0;
+long long NumObjectsFreed = 0;
 long long NumBytesAllocated = 0;
+long long NumFreeListHits = 0;
+long long NumFreeListMisses = 0;
+long long NumLazySweepUnits = 0;
+long long NumMinorGCs = 0;
+static int MinorsSinceMajor = 0;
+double GCPauseTotal = 0;
+double GCPauseMax = 0;
+double GCRootScanTotal = 0;
+double GCMarkTotal = 0;
+double GCSweepTotal = 0;
+double GCConcMarkTotal = 0;
+static long long NumPauses = 0;
+static long long NumPagesEvacuated = 0;
+static long long NumBytesEvacuated = 0;
+static long long PauseHistogram[NUM_PAUSE_BUCKETS];
+static long long AllocSizeHistogram[NUM_ALLOC_SIZE_BUCKETS];
+static int CountAllocSizes = 0;
+/* one JSON object per collection pause, see SAFEGC_LOG */
+static FILE *GCLog = NULL;
+/* concurrent marking is under way: stores log what they overwrite, new objects are born marked */
+static volatile int MarkingActive = 0;
+static long long RSSAtLastReport = 0;
+/* bytes marked by the last collection and the allocation volume that triggers the next */
+static long long LiveBytes = 0;
+static long long LastMarkedBytes = 0;
+static long long GCTrigger = GC_THRESHOLD;
+/* fraction of the heap that survived each collection */
+static double SurvivalLast = 0;
+static double SurvivalTotal = 0;
+static double SurvivalMin = 1;
+static double SurvivalMax = 0;
+static FreeChunk *FreeLists[NUM_SIZE_CLASSES];
+/* stamped into the Alignment field of listed chunks, bumped when the lists are rebuilt */
+static unsigned short ListEpoch = 1;
+/* tunables, read from the environment by initHeap() */
+static int UnalignedScan = 0;
+static int ConservativeScan = 0;
+static int Generational = 0;
+static int Concurrent = 0;
+static int EvacuatePercent = 0;
+static size_t CommitChunk = COMMIT_SIZE;
+static int DecommitLazily = 0;
+static int DecommitInBackground = 0;
+static int HugePages = 0;
+/* scan the collecting thread's stack with the compiler's stack maps, see stackmap.c */
+static int PreciseStack = 0;
+static long long NumPreciseStackScans = 0;
+static long long NumConservativeStackScans = 0;
+static int MinorPerMajor = MINOR_PER_MAJOR;
+static int NumMarkThreads = 1;
+static int NumSweepThreads = 1;
+static int NumGCThreads = 1;
+static int LazySweep = 0;
+static size_t MaxMarkStackChunks = MAX_MARK_STACK_CHUNKS;
+static long long GCGrowthPercent = GC_GROWTH_PERCENT;
+static long long GCMinTrigger = GC_THRESHOLD;
+static long long GCMaxTrigger = GC_MAX_THRESHOLD;
+/* serializes everything but the threads' buffer allocations */
+static pthread_mutex_t HeapLock = PTHREAD_MUTEX_INITIALIZER;
+static long long BytesSinceGC = 0;
+static Segment *CurSeg = NULL;
 extern char  etext, edata, end;
 //static void myfree(void *Ptr);
-static void checkAndRunGC();
+static void checkAndRunGC(size_t Sz);
+static int sweepNextUnit();
+static void flushSATBBuffer(GCThread *Thread);
+static void addBigExtent(char *Start, size_t Size);
+static void startGCThreads();
+static void startDecommitThread();
+
+/*
+ * The collector's growable arrays are mapped, not malloc'd: nothing may
+ * call malloc or free while the world is stopped, since a suspended
+ * mutator may hold a malloc arena lock. Returns NULL on failure.
+ */
+static void *growArray(void *Array, size_t OldBytes, size_t NewBytes)
+{
+	void *New = mmap(NULL, NewBytes, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (New == MAP_FAILED)
+	{
+		return NULL;
+	}
+	if (Array)
+	{
+		memcpy(New, Array, OldBytes);
+		munmap(Array, OldBytes);
+	}
+	return New;
+}
+
+static void freeArray(void *Array, size_t Bytes)
+{
+	if (Array)
+	{
+		munmap(Array, Bytes);
+	}
+}
+
+static void swapElements(char *A, char *B, size_t Size)
+{
+	while (Size--)
+	{
+		char Tmp = *A;
+		*A++ = *B;
+		*B++ = Tmp;
+	}
+}
+
+static void siftDown(char *Base, size_t Root, size_t Num, size_t Size, int (*Compare)(const void*, const void*))
+{
+	size_t Child;
+
+	while ((Child = 2 * Root + 1) < Num)
+	{
+		if (Child + 1 < Num && Compare(Base + Child * Size, Base + (Child + 1) * Size) < 0)
+		{
+			Child++;
+		}
+		if (Compare(Base + Root * Size, Base + Child * Size) >= 0)
+		{
+			return;
+		}
+		swapElements(Base + Root * Size, Base + Child * Size, Size);
+		Root = Child;
+	}
+}
+
+/* heap sort: unlike glibc's qsort, it never allocates a scratch buffer */
+static void sortArray(void *Array, size_t Num, size_t Size, int (*Compare)(const void*, const void*))
+{
+	char *Base = (char*)Array;
+	size_t Iter;
+
+	for (Iter = Num / 2; Iter-- > 0;)
+	{
+		siftDown(Base, Iter, Num, Size, Compare);
+	}
+	for (Iter = Num; Iter-- > 1;)
+	{
+		swapElements(Base, Base + Iter * Size, Size);
+		siftDown(Base, 0, Iter, Size, Compare);
+	}
+}
 
 static void setAllocPtr(Segment *Seg, char *Ptr) { Seg->Other.AllocPtr = Ptr; }
 static void setCommitPtr(Segment *Seg, char *Ptr) { Seg->Other.CommitPtr = Ptr; }
@@ -17,19 +158,40 @@ static char* getAllocPtr(Segment *Seg) { return Seg->Other.AllocPtr; }
 static char* getCommitPtr(Segment *Seg) { return Seg->Other.CommitPtr; }
 static char* getReservePtr(Segment *Seg) { return Seg->Other.ReservePtr; }
 static char* getDataPtr(Segment *Seg) { return Seg->Other.DataPtr; }
+static void setBitmapCommitPtr(Segment *Seg, char *Ptr) { Seg->Other.BitmapCommitPtr = Ptr; }
+static char* getBitmapCommitPtr(Segment *Seg) { return Seg->Other.BitmapCommitPtr; }
 static void setBigAlloc(Segment *Seg, int BigAlloc) { Seg->Other.BigAlloc = BigAlloc; }
 static int getBigAlloc(Segment *Seg) { return Seg->Other.BigAlloc; }
-static void addToSegmentList(Segment *Seg)
+/*
+ * SegmentTable maps the high address bits to the segment covering
+ * them; Segments lists the same segments densely for iteration.
+ * HeapMin and HeapMax bound every segment's data area, so most
+ * non-heap words are rejected before touching the table.
+ */
+static Segment *SegmentTable[SEGMENT_TABLE_SIZE];
+static Segment *Segments[SEGMENT_TABLE_SIZE];
+static int NumSegments = 0;
+static ulong64 HeapMin = ~0ULL;
+static ulong64 HeapMax = 0;
+
+static void removeFromSegmentTable(int SegIdx)
 {
-	SegmentList *L = malloc(sizeof(SegmentList));
-	if (L == NULL)
-	{
-		printf("Unable to allocate list node\n");
-		exit(0);
-	}
-	L->Segment = Seg;
-	L->Next = Segments;
-	Segments = L;
+	Segment *Seg = Segments[SegIdx];
+	SegmentTable[ADDR_TO_SEGMENT_INDEX(Seg)] = NULL;
+	Segments[SegIdx] = Segments[--NumSegments];
+}
+
+static void addToSegmentTable(Segment *Seg)
+{
+	ulong64 Start = (ulong64)getDataPtr(Seg);
+	ulong64 End = (ulong64)getReservePtr(Seg);
+
+	assert(ADDR_TO_SEGMENT_INDEX(Seg) < SEGMENT_TABLE_SIZE);
+	assert(SegmentTable[ADDR_TO_SEGMENT_INDEX(Seg)] == NULL);
+	SegmentTable[ADDR_TO_SEGMENT_INDEX(Seg)] = Seg;
+	Segments[NumSegments++] = Seg;
+	HeapMin = (Start < HeapMin) ? Start : HeapMin;
+	HeapMax = (End > HeapMax) ? End : HeapMax;
 }
 
 static void allowAccess(void *Ptr, size_t Size)
@@ -45,8 +207,175 @@ static void allowAccess(void *Ptr, size_t Size)
 	}
 }
 
+static ulong64* getBitmapWord(char *Ptr, ulong64 *Bit)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	ulong64 Granule = ((ulong64)Ptr - (ulong64)Seg) / GRANULE_SIZE;
+	*Bit = 1ULL << (Granule & 63);
+	return &Seg->StartBitmap[Granule / 64];
+}
+
+/* the mark bitmap mirrors the object-start bitmap one bitmap further on */
+static ulong64* getMarkWord(char *Ptr, ulong64 *Bit)
+{
+	return getBitmapWord(Ptr, Bit) + NUM_BITMAP_WORDS;
+}
+
+static int isMarked(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord((char*)Header, &Bit);
+	return (*Word & Bit) != 0;
+}
+
+static void setMarkAtomic(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord((char*)Header, &Bit);
+	__atomic_fetch_or(Word, Bit, __ATOMIC_RELAXED);
+}
+
+/* the generational mode keeps marks across collections, a freed object must drop its own */
+static void clearMark(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord((char*)Header, &Bit);
+	*Word &= ~Bit;
+}
+
+static unsigned char* getCard(char *Ptr)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	return &Seg->CardTable[((ulong64)Ptr - (ulong64)Seg) / CARD_SIZE];
+}
+
+/* buffers of different threads can share a bitmap word, so updates are atomic */
+static void setObjectStart(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getBitmapWord((char*)Header, &Bit);
+	__atomic_fetch_or(Word, Bit, __ATOMIC_RELAXED);
+}
+
+static void clearObjectStart(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getBitmapWord((char*)Header, &Bit);
+	__atomic_fetch_and(Word, ~Bit, __ATOMIC_RELAXED);
+}
+
+/* highest object start at or below Ptr within Ptr's page, or NULL */
+static ObjHeader* findObjectStart(char *Ptr)
+{
+	ulong64 Bit, FirstBit;
+	ulong64 *Word = getBitmapWord(Ptr, &Bit);
+	ulong64 *FirstWord = getBitmapWord(ADDR_TO_PAGE(Ptr), &FirstBit);
+	ulong64 Bits = *Word & (((Bit - 1) << 1) | 1);
+
+	while (Bits == 0)
+	{
+		if (Word == FirstWord)
+		{
+			return NULL;
+		}
+		Word--;
+		Bits = *Word;
+	}
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	ulong64 Granule = (Word - Seg->StartBitmap) * 64 + (63 - __builtin_clzll(Bits));
+	return (ObjHeader*)((char*)Seg + Granule * GRANULE_SIZE);
+}
+
+static long long getRSS()
+{
+	long long NumPages = 0, NumResident = 0;
+	FILE *F = fopen("/proc/self/statm", "r");
+	if (F == NULL)
+	{
+		return 0;
+	}
+	if (fscanf(F, "%lld %lld", &NumPages, &NumResident) != 2)
+	{
+		NumResident = 0;
+	}
+	fclose(F);
+	return NumResident * PAGE_SIZE;
+}
+
+/* integer tunable from the environment, Default when unset */
+static long long getEnvOption(const char *Name, long long Default)
+{
+	char *Value = getenv(Name);
+	return (Value && *Value) ? atoll(Value) : Default;
+}
+
+static void initHeap()
+{
+	UnalignedScan = getEnvOption("SAFEGC_UNALIGNED_SCAN", 0) != 0;
+	ConservativeScan = getEnvOption("SAFEGC_CONSERVATIVE", 0) != 0;
+	Generational = getEnvOption("SAFEGC_GENERATIONAL", 0) != 0;
+	MinorPerMajor = getEnvOption("SAFEGC_MINOR_PER_MAJOR", MINOR_PER_MAJOR);
+	Concurrent = getEnvOption("SAFEGC_CONCURRENT", 0) != 0;
+	/* the snapshot barrier does not maintain the cards */
+	Generational = Generational && !Concurrent;
+	EvacuatePercent = getEnvOption("SAFEGC_EVACUATE", 0);
+	/* without precise layouts every object would be pinned */
+	EvacuatePercent = (ConservativeScan || UnalignedScan) ? 0 : EvacuatePercent;
+	MaxMarkStackChunks = getEnvOption("SAFEGC_MARK_STACK_CHUNKS", MAX_MARK_STACK_CHUNKS);
+	NumMarkThreads = getEnvOption("SAFEGC_MARK_THREADS", 1);
+	NumMarkThreads = (NumMarkThreads < 1) ? 1 : NumMarkThreads;
+	NumMarkThreads = (NumMarkThreads > MAX_GC_THREADS) ? MAX_GC_THREADS : NumMarkThreads;
+	NumSweepThreads = getEnvOption("SAFEGC_SWEEP_THREADS", NumMarkThreads);
+	NumSweepThreads = (NumSweepThreads < 1) ? 1 : NumSweepThreads;
+	NumSweepThreads = (NumSweepThreads > MAX_GC_THREADS) ? MAX_GC_THREADS : NumSweepThreads;
+	NumGCThreads = (NumMarkThreads > NumSweepThreads) ? NumMarkThreads : NumSweepThreads;
+	LazySweep = getEnvOption("SAFEGC_LAZY_SWEEP", 0) != 0;
+	CommitChunk = Align(getEnvOption("SAFEGC_COMMIT_KB", COMMIT_SIZE >> 10) << 10, PAGE_SIZE);
+	CommitChunk = (CommitChunk < PAGE_SIZE) ? PAGE_SIZE : CommitChunk;
+	DecommitLazily = getEnvOption("SAFEGC_MADV_FREE", 0) != 0;
+	DecommitInBackground = getEnvOption("SAFEGC_DECOMMIT_THREAD", 0) != 0;
+	HugePages = getEnvOption("SAFEGC_HUGE_PAGES", 0) != 0;
+	/* parsed now: nothing may call malloc while the world is stopped */
+	PreciseStack = getEnvOption("SAFEGC_PRECISE_STACK", 0) != 0 && loadStackMaps();
+	char *LogPath = getenv("SAFEGC_LOG");
+	if (LogPath && *LogPath)
+	{
+		GCLog = strcmp(LogPath, "-") ? fopen(LogPath, "a") : stderr;
+		if (GCLog == NULL)
+		{
+			printf("unable to open %s\n", LogPath);
+			exit(0);
+		}
+	}
+	CountAllocSizes = GCLog || getEnvOption("SAFEGC_ALLOC_HISTOGRAM", 0) != 0;
+	/* commits that end inside a huge page would split its mapping */
+	CommitChunk = HugePages ? Align(CommitChunk, HUGE_PAGE_SIZE) : CommitChunk;
+	GCGrowthPercent = getEnvOption("SAFEGC_GROWTH_PERCENT", GC_GROWTH_PERCENT);
+	GCGrowthPercent = (GCGrowthPercent < 1) ? 1 : GCGrowthPercent;
+	GCMinTrigger = getEnvOption("SAFEGC_MIN_TRIGGER_MB", GC_THRESHOLD >> 20) << 20;
+	GCMinTrigger = (GCMinTrigger < MAX_SMALL_SIZE) ? MAX_SMALL_SIZE : GCMinTrigger;
+	GCMaxTrigger = getEnvOption("SAFEGC_MAX_TRIGGER_MB", GC_MAX_THRESHOLD >> 20) << 20;
+	GCMaxTrigger = (GCMaxTrigger < GCMinTrigger) ? GCMinTrigger : GCMaxTrigger;
+	GCTrigger = GCMinTrigger;
+	RSSAtLastReport = getRSS();
+	/* started now: creating a thread mallocs, which the pauses must not */
+	if (NumGCThreads > 1)
+	{
+		startGCThreads();
+	}
+	if (DecommitInBackground)
+	{
+		startDecommitThread();
+	}
+}
+
 static Segment* allocateSegment(int BigAlloc)
 {
+	if (NumSegments == 0)
+	{
+		initHeap();
+	}
+
 	void* Base = mmap(NULL, SEGMENT_SIZE * 2, PROT_NONE, MAP_ANON|MAP_PRIVATE, -1, 0);
 	if (Base == MAP_FAILED)
 	{
@@ -56,7 +385,7 @@ static Segment* allocateSegment(int BigAlloc)
 
 	/* segments are aligned to segment size */
 	Segment *Segment = (struct Segment*)Align((ulong64)Base, SEGMENT_SIZE);
-	allowAccess(Segment, METADATA_SIZE);
+	allowAccess(Segment, SIZE_METADATA_SIZE);
 
 	char *AllocPtr = (char*)Segment + METADATA_SIZE;
 	char *ReservePtr = (char*)Segment + SEGMENT_SIZE;
@@ -64,28 +393,108 @@ static Segment* allocateSegment(int BigAlloc)
 	setReservePtr(Segment, ReservePtr);
 	setCommitPtr(Segment, AllocPtr);
 	setDataPtr(Segment, AllocPtr);
+	ulong64 Bit;
+	setBitmapCommitPtr(Segment, ADDR_TO_PAGE(getBitmapWord(AllocPtr, &Bit)));
+	Segment->Other.CardCommitPtr = ADDR_TO_PAGE(getCard(AllocPtr));
+	Segment->Other.MapBase = Base;
 	setBigAlloc(Segment, BigAlloc);
-	addToSegmentList(Segment);
+	addToSegmentTable(Segment);
+
+	/* METADATA_SIZE is a multiple of HUGE_PAGE_SIZE, so the data area is aligned */
+	if (HugePages && madvise(AllocPtr, ReservePtr - AllocPtr, MADV_HUGEPAGE) == -1)
+	{
+		printf("transparent huge pages are not available\n");
+		HugePages = 0;
+	}
 	return Segment;
 }
 
+/*
+ * the bitmaps and cards describing [DataPtr, Limit] must be accessible;
+ * Limit itself is included as lookups accept pointers up to AllocPtr.
+ * BitmapCommitPtr tracks the start bitmap, the mark bitmap is
+ * committed over the same range.
+ */
+static void commitBitmap(Segment *Seg, char *Limit)
+{
+	ulong64 Bit;
+	char *BitmapEnd = (char*)(getBitmapWord(Limit, &Bit) + 1);
+	char *BitmapCommitPtr = getBitmapCommitPtr(Seg);
+	char *CardEnd = (char*)getCard(Limit) + 1;
+	char *CardCommitPtr = Seg->Other.CardCommitPtr;
+
+	if (BitmapEnd > BitmapCommitPtr)
+	{
+		char *NewBitmapCommitPtr = (char*)Align((ulong64)BitmapEnd, PAGE_SIZE);
+		allowAccess(BitmapCommitPtr, NewBitmapCommitPtr - BitmapCommitPtr);
+		allowAccess(BitmapCommitPtr + BITMAP_SIZE, NewBitmapCommitPtr - BitmapCommitPtr);
+		setBitmapCommitPtr(Seg, NewBitmapCommitPtr);
+	}
+	if (CardEnd > CardCommitPtr)
+	{
+		char *NewCardCommitPtr = (char*)Align((ulong64)CardEnd, PAGE_SIZE);
+		allowAccess(CardCommitPtr, NewCardCommitPtr - CardCommitPtr);
+		Seg->Other.CardCommitPtr = NewCardCommitPtr;
+	}
+}
+
+/* all survivors of a collection are old, so no card needs to stay dirty */
+static void clearCards()
+{
+	int SegIdx;
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		Segment *Seg = Segments[SegIdx];
+		unsigned char *Start = getCard(getDataPtr(Seg));
+		unsigned char *End = getCard(getAllocPtr(Seg)) + 1;
+		memset(Start, 0, End - Start);
+	}
+}
+
+/* unmark the whole heap before marking */
+static void clearMarkBitmaps()
+{
+	int SegIdx;
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		Segment *Seg = Segments[SegIdx];
+		ulong64 Bit;
+		ulong64 *Start = getMarkWord(getDataPtr(Seg), &Bit);
+		ulong64 *End = getMarkWord(getAllocPtr(Seg), &Bit) + 1;
+		memset(Start, 0, (End - Start) * sizeof(ulong64));
+	}
+}
+
+/* make the page at AllocPtr accessible, committing CommitChunk bytes at a time */
 static void extendCommitSpace(Segment *Seg)
 {
 	char *AllocPtr = getAllocPtr(Seg);
 	char *CommitPtr = getCommitPtr(Seg);
 	char *ReservePtr = getReservePtr(Seg);
-	char *NewCommitPtr = CommitPtr + COMMIT_SIZE;
+	char *NewCommitPtr = CommitPtr + CommitChunk;
 
-	assert(AllocPtr == CommitPtr);
-	if (NewCommitPtr <= ReservePtr)
+	assert(AllocPtr < ReservePtr);
+	if (AllocPtr < CommitPtr)
 	{
-		allowAccess(CommitPtr, COMMIT_SIZE);
-		setCommitPtr(Seg, NewCommitPtr);
+		return;
 	}
-	else
+	NewCommitPtr = (NewCommitPtr < ReservePtr) ? NewCommitPtr : ReservePtr;
+	commitBitmap(Seg, NewCommitPtr);
+	allowAccess(CommitPtr, NewCommitPtr - CommitPtr);
+	setCommitPtr(Seg, NewCommitPtr);
+}
+
+/* a page that was never used, from the bump region of the small-object segment */
+static char* takeFreshPage()
+{
+	if (CurSeg == NULL || getAllocPtr(CurSeg) == getReservePtr(CurSeg))
 	{
-		assert(CommitPtr == ReservePtr);
+		CurSeg = allocateSegment(0);
 	}
+	extendCommitSpace(CurSeg);
+	char *Page = getAllocPtr(CurSeg);
+	setAllocPtr(CurSeg, Page + PAGE_SIZE);
+	return Page;
 }
 
 static unsigned short* getSizeMetadata(char *Ptr)
@@ -96,487 +505,3120 @@ static unsigned short* getSizeMetadata(char *Ptr)
 	return &Seg->Size[PageNo];
 }
 
-static void createHole(Segment *Seg)
+/* size class of a chunk: floor(log2(payload)), clamped to the last class */
+static int getSizeClass(size_t ChunkSize)
 {
-	char *AllocPtr = getAllocPtr(Seg);
-	char *CommitPtr = getCommitPtr(Seg);
-	size_t HoleSz = CommitPtr - AllocPtr;
-	if (HoleSz > 0)
+	size_t Payload = ChunkSize - OBJ_HEADER_SIZE;
+	int Class = (63 - __builtin_clzll(Payload)) - MIN_SIZE_CLASS_SHIFT;
+	assert(Class >= 0);
+	return (Class < NUM_SIZE_CLASSES) ? Class : NUM_SIZE_CLASSES - 1;
+}
+
+/*
+ * holes smaller than a FreeChunk can not hold the links and stay unlisted.
+ * Chunks listed before the lists were last rebuilt carry a stale epoch.
+ */
+static int isListedChunk(FreeChunk *Chunk)
+{
+	return Chunk->Status == FREE && Chunk->Alignment == ListEpoch;
+}
+
+static void addToFreeList(FreeChunk *Chunk)
+{
+	assert(Chunk->Status == FREE);
+	if (Chunk->Size < MIN_FREE_CHUNK_SIZE)
 	{
-		assert(HoleSz >= 8);
-		ObjHeader *Header = (ObjHeader*)AllocPtr;
-		Header->Size = HoleSz;
-		Header->Status = 0;
-		Header->Alignment = 0;
-		setAllocPtr(Seg, CommitPtr);
-		myfree(AllocPtr + OBJ_HEADER_SIZE);
-		NumBytesFreed -= HoleSz;
+		return;
+	}
+	int Class = getSizeClass(Chunk->Size);
+	Chunk->Alignment = ListEpoch;
+	Chunk->Prev = NULL;
+	Chunk->Next = FreeLists[Class];
+	if (FreeLists[Class])
+	{
+		FreeLists[Class]->Prev = Chunk;
 	}
+	FreeLists[Class] = Chunk;
 }
 
-static void reclaimMemory(void *Ptr, size_t Size)
+static void removeFromFreeList(FreeChunk *Chunk)
 {
-	assert((Size % PAGE_SIZE) == 0);
-	assert(((ulong64)Ptr & (PAGE_SIZE-1)) == 0);
-	
-	int Ret = mprotect(Ptr, Size, PROT_NONE);
-	if (Ret == -1)
+	assert(isListedChunk(Chunk));
+	if (Chunk->Prev)
 	{
-		printf("unable to mprotect %s():%d\n", __func__, __LINE__);
-		exit(0);
+		Chunk->Prev->Next = Chunk->Next;
 	}
-	Ret = madvise(Ptr, Size, MADV_DONTNEED);
-	if (Ret == -1)
+	else
 	{
-		printf("unable to reclaim physical page %s():%d\n", __func__, __LINE__);
-		exit(0);
+		int Class = getSizeClass(Chunk->Size);
+		assert(FreeLists[Class] == Chunk);
+		FreeLists[Class] = Chunk->Next;
+	}
+	if (Chunk->Next)
+	{
+		Chunk->Next->Prev = Chunk->Prev;
 	}
+	Chunk->Alignment = 0;
 }
 
-/* used by the GC to free objects. */
-void myfree(void *Ptr)
+/* the sweeper rediscovers every hole, so the lists start out empty */
+static void resetFreeLists()
 {
-	ObjHeader *Header = (ObjHeader*)((char*)Ptr - OBJ_HEADER_SIZE);
-	assert((Header->Status & FREE) == 0);
-	NumBytesFreed += Header->Size;
+	memset(FreeLists, 0, sizeof(FreeLists));
+	ListEpoch = (ListEpoch == 0xffff) ? 1 : ListEpoch + 1;
+}
 
-	if (Header->Size > COMMIT_SIZE)
+static void addToSweepContext(SweepContext *Ctx, FreeChunk *Chunk)
+{
+	if (!Ctx->Private)
+	{
+		addToFreeList(Chunk);
+		return;
+	}
+	if (Chunk->Size < MIN_FREE_CHUNK_SIZE)
 	{
-		assert((Header->Size % PAGE_SIZE) == 0);
-		assert(((ulong64)Header & (PAGE_SIZE-1)) == 0);
-		size_t Size = Header->Size;
-		char *Start = (char*)Header;
-		size_t Iter;
-		for (Iter = 0; Iter < Size; Iter += PAGE_SIZE)
-		{
-			unsigned short *SzMeta = getSizeMetadata((char*)Start + Iter);
-			SzMeta[0] = PAGE_SIZE;
-		}
-		Header->Status = FREE;
-		reclaimMemory(Header, Header->Size);
 		return;
 	}
+	int Class = getSizeClass(Chunk->Size);
+	Chunk->Alignment = ListEpoch;
+	Chunk->Prev = NULL;
+	Chunk->Next = Ctx->Heads[Class];
+	if (Ctx->Heads[Class])
+	{
+		Ctx->Heads[Class]->Prev = Chunk;
+	}
+	else
+	{
+		Ctx->Tails[Class] = Chunk;
+	}
+	Ctx->Heads[Class] = Chunk;
+}
 
-	unsigned short *SzMeta = getSizeMetadata((char*)Header);
-	SzMeta[0] += Header->Size;
-	assert(SzMeta[0] <= PAGE_SIZE);
-	Header->Status = FREE;
-	if (SzMeta[0] == PAGE_SIZE)
+static void spliceSweepContext(SweepContext *Ctx)
+{
+	int Class;
+	for (Class = 0; Class < NUM_SIZE_CLASSES; Class++)
 	{
-		char *Page = ADDR_TO_PAGE(Ptr);
-		reclaimMemory(Page, PAGE_SIZE);
+		if (Ctx->Heads[Class] == NULL)
+		{
+			continue;
+		}
+		Ctx->Tails[Class]->Next = FreeLists[Class];
+		if (FreeLists[Class])
+		{
+			FreeLists[Class]->Prev = Ctx->Tails[Class];
+		}
+		FreeLists[Class] = Ctx->Heads[Class];
+		Ctx->Heads[Class] = Ctx->Tails[Class] = NULL;
 	}
+	NumBytesFreed += Ctx->BytesFreed;
+	NumObjectsFreed += Ctx->ObjectsFreed;
+	Ctx->BytesFreed = 0;
+	Ctx->ObjectsFreed = 0;
 }
 
-static void* BigAlloc(size_t Size)
+/* a page is about to be reclaimed: none of its holes may stay listed */
+static void removePageFromFreeLists(char *Page)
 {
-	size_t AlignedSize = Align(Size + OBJ_HEADER_SIZE, PAGE_SIZE);
-	NumBytesAllocated += AlignedSize;
-	checkAndRunGC(AlignedSize);
-	assert(AlignedSize <= SEGMENT_SIZE - METADATA_SIZE);
-	static Segment *CurSeg = NULL;
-	if (CurSeg == NULL)
+	char *Ptr = Page;
+	while (Ptr < Page + PAGE_SIZE)
 	{
-		CurSeg = allocateSegment(1);
+		FreeChunk *Chunk = (FreeChunk*)Ptr;
+		assert(Chunk->Status == FREE);
+		Ptr += Chunk->Size;
+		if (isListedChunk(Chunk))
+		{
+			removeFromFreeList(Chunk);
+		}
 	}
-	char *AllocPtr = getAllocPtr(CurSeg);
-	char *CommitPtr = getCommitPtr(CurSeg);
-	char *NewAllocPtr = AllocPtr + AlignedSize;
-	char *ReservePtr = getReservePtr(CurSeg);
-	if (NewAllocPtr > ReservePtr)
+}
+
+static FreeChunk* findFit(FreeChunk *Chunk, size_t AlignedSize)
+{
+	int Iter;
+	for (Iter = 0; Chunk && Iter < FIRST_FIT_LIMIT; Iter++, Chunk = Chunk->Next)
 	{
-		CurSeg = allocateSegment(1);
-		return BigAlloc(Size);
+		if (Chunk->Size >= AlignedSize)
+		{
+			return Chunk;
+		}
 	}
-	assert(AllocPtr == CommitPtr);
-	allowAccess(CommitPtr, AlignedSize);
-	setAllocPtr(CurSeg, NewAllocPtr);
-	setCommitPtr(CurSeg, NewAllocPtr);
+	return NULL;
+}
 
-	unsigned short *SzMeta = getSizeMetadata(AllocPtr);
-	SzMeta[0] = 1;
+/*
+ * Take a hole left by the sweeper that can hold AlignedSize bytes; the
+ * caller allocates from the whole hole and frees what it does not use.
+ * Every chunk in a class above the request's floor class is big
+ * enough, so only the floor class needs a (bounded) fit search.
+ */
+static FreeChunk* takeFreeChunk(size_t AlignedSize)
+{
+	int Class = getSizeClass(AlignedSize);
+	FreeChunk *Chunk = findFit(FreeLists[Class], AlignedSize);
+	int Iter;
 
-	ObjHeader *Header = (ObjHeader*)AllocPtr;
-	Header->Size = AlignedSize;
-	Header->Status = 0;
-	Header->Alignment = 0;
-	Header->Type = 0;
-	return AllocPtr + OBJ_HEADER_SIZE;
+	for (Iter = Class + 1; Chunk == NULL && Iter < NUM_SIZE_CLASSES; Iter++)
+	{
+		Chunk = FreeLists[Iter];
+	}
+	if (Chunk == NULL)
+	{
+		return NULL;
+	}
+	removeFromFreeList(Chunk);
+
+	unsigned short *SzMeta = getSizeMetadata((char*)Chunk);
+	assert(SzMeta[0] >= Chunk->Size);
+	SzMeta[0] -= Chunk->Size;
+	return Chunk;
 }
 
+/*
+ * Freed pages are not returned to the kernel one by one: reclaimMemory()
+ * queues them and flushDecommits() protects and discards the queued
+ * runs, merged where they touch, once a sweep ends or enough pages were
+ * freed by myfree. Only BigAlloc hands freed pages out again, and it
+ * waits for their runs first. Pages left in place by MADV_FREE or by
+ * alignToHugePages() may keep their old contents.
+ */
+static pthread_mutex_t DecommitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DecommitCond = PTHREAD_COND_INITIALIZER;
+static DecommitRun *DecommitRuns = NULL;
+static size_t NumDecommitRuns = 0;
+static size_t MaxDecommitRuns = 0;
+static size_t NumPendingPages = 0;
+static long long NumPagesDecommitted = 0;
+static long long NumDecommitCalls = 0;
+/* the background thread is working on runs it took off the queue */
+static int DecommitBusy = 0;
+static pthread_cond_t DecommitDone = PTHREAD_COND_INITIALIZER;
 
-void *_mymalloc(size_t Size)
+static void reclaimMemory(void *Ptr, size_t Size)
 {
-	size_t AlignedSize = Align(Size, 8) + OBJ_HEADER_SIZE;
+	assert((Size % PAGE_SIZE) == 0);
+	assert(((ulong64)Ptr & (PAGE_SIZE-1)) == 0);
 
-	if (AlignedSize > COMMIT_SIZE)
+	pthread_mutex_lock(&DecommitLock);
+	NumPendingPages += Size / PAGE_SIZE;
+	if (NumDecommitRuns > 0)
 	{
-		return BigAlloc(Size);
+		DecommitRun *Last = &DecommitRuns[NumDecommitRuns - 1];
+		if (Last->Start + Last->Size == (char*)Ptr)
+		{
+			Last->Size += Size;
+			pthread_mutex_unlock(&DecommitLock);
+			return;
+		}
 	}
-	checkAndRunGC(AlignedSize);
-	assert(Size != 0);
-	assert(sizeof(struct OtherMetadata) <= OTHER_METADATA_SIZE);
-	assert(sizeof(struct Segment) == METADATA_SIZE);
+	if (NumDecommitRuns == MaxDecommitRuns)
+	{
+		size_t NewMax = MaxDecommitRuns ? MaxDecommitRuns * 2 : 1024;
+		DecommitRuns = growArray(DecommitRuns, MaxDecommitRuns * sizeof(DecommitRun), NewMax * sizeof(DecommitRun));
+		MaxDecommitRuns = NewMax;
+		if (DecommitRuns == NULL)
+		{
+			printf("unable to queue freed pages\n");
+			exit(0);
+		}
+	}
+	DecommitRuns[NumDecommitRuns].Start = (char*)Ptr;
+	DecommitRuns[NumDecommitRuns].Size = Size;
+	NumDecommitRuns++;
+	pthread_mutex_unlock(&DecommitLock);
+}
+
+static int compareDecommitRuns(const void *A, const void *B)
+{
+	char *StartA = ((const DecommitRun*)A)->Start;
+	char *StartB = ((const DecommitRun*)B)->Start;
+	return (StartA > StartB) - (StartA < StartB);
+}
 
-	static Segment *CurSeg = NULL;
+/* all pages of the huge page are freed, none is still waiting in the bump region */
+static int isFreeHugePage(char *Start)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Start);
+	char *Page;
 
-	if (CurSeg == NULL)
+	if (Start < getDataPtr(Seg) || Start + HUGE_PAGE_SIZE > getAllocPtr(Seg))
 	{
-		CurSeg = allocateSegment(0);
+		return 0;
 	}
-	char *AllocPtr = getAllocPtr(CurSeg);
-	char *CommitPtr = getCommitPtr(CurSeg);
-	char *NewAllocPtr = AllocPtr + AlignedSize;
-	if (NewAllocPtr > CommitPtr)
+	for (Page = Start; Page < Start + HUGE_PAGE_SIZE; Page += PAGE_SIZE)
 	{
-		if (AllocPtr != CommitPtr)
+		if (getSizeMetadata(Page)[0] != PAGE_SIZE)
 		{
-			/* Free remaining space on this page */
-			createHole(CurSeg);
-		}
-		extendCommitSpace(CurSeg);
-		AllocPtr = getAllocPtr(CurSeg);
-		NewAllocPtr = AllocPtr + AlignedSize;
-		CommitPtr = getCommitPtr(CurSeg);
-		if (NewAllocPtr > CommitPtr)
-		{
-			CurSeg = allocateSegment(0);
-			return _mymalloc(Size);
+			return 0;
 		}
 	}
-
-	NumBytesAllocated += AlignedSize;
-	setAllocPtr(CurSeg, NewAllocPtr);
-	ObjHeader *Header = (ObjHeader*)AllocPtr;
-	Header->Size = AlignedSize;
-	Header->Status = 0;
-	Header->Alignment = 0;
-	Header->Type = 0;
-	return AllocPtr + OBJ_HEADER_SIZE;
+	return 1;
 }
 
+/*
+ * Decommitting part of a huge page splits it into small ones, so the
+ * run is cut to the huge pages it covers. A partially covered huge
+ * page is only taken along when the rest of it was freed earlier;
+ * otherwise its freed pages stay committed.
+ */
+static size_t alignToHugePages(char **Start, size_t Size)
+{
+	char *First = ADDR_TO_HUGE_PAGE(*Start);
+	char *Last = (char*)Align((ulong64)(*Start + Size), HUGE_PAGE_SIZE);
 
-/************************************************************************************************
- * for storing reference to the header of reachable objects in the form of singly linked list 	*
- ************************************************************************************************/
-typedef struct UnscannedList {
-	unsigned char *objHeader;
-	struct UnscannedList *next;
-} UnscannedList;
+	if (First < *Start && !isFreeHugePage(First))
+	{
+		First += HUGE_PAGE_SIZE;
+	}
+	if (Last > *Start + Size && Last - HUGE_PAGE_SIZE >= First && !isFreeHugePage(Last - HUGE_PAGE_SIZE))
+	{
+		Last -= HUGE_PAGE_SIZE;
+	}
+	*Start = First;
+	return (Last > First) ? Last - First : 0;
+}
 
-UnscannedList *UnscannedListHead = NULL;
-UnscannedList *UnscannedListTail = NULL;
+static void decommitRuns(DecommitRun *Runs, size_t NumRuns, size_t MaxRuns)
+{
+	size_t Iter, Next;
+
+	/* parallel sweepers queue their runs interleaved */
+	sortArray(Runs, NumRuns, sizeof(DecommitRun), compareDecommitRuns);
+	for (Iter = 0; Iter < NumRuns; Iter = Next)
+	{
+		char *Start = Runs[Iter].Start;
+		size_t Size = Runs[Iter].Size;
+		for (Next = Iter + 1; Next < NumRuns && Start + Size == Runs[Next].Start; Next++)
+		{
+			Size += Runs[Next].Size;
+		}
+		if (HugePages && (Size = alignToHugePages(&Start, Size)) == 0)
+		{
+			continue;
+		}
+
+		int Ret = mprotect(Start, Size, PROT_NONE);
+		if (Ret == -1)
+		{
+			printf("unable to mprotect %s():%d\n", __func__, __LINE__);
+			exit(0);
+		}
+		/* MADV_FREE lets the kernel take the pages only when it needs them */
+		Ret = DecommitLazily ? madvise(Start, Size, MADV_FREE) : -1;
+		if (Ret == -1)
+		{
+			Ret = madvise(Start, Size, MADV_DONTNEED);
+		}
+		if (Ret == -1)
+		{
+			printf("unable to reclaim physical page %s():%d\n", __func__, __LINE__);
+			exit(0);
+		}
+		__atomic_add_fetch(&NumPagesDecommitted, Size / PAGE_SIZE, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&NumDecommitCalls, 1, __ATOMIC_RELAXED);
+	}
+	freeArray(Runs, MaxRuns * sizeof(DecommitRun));
+}
+
+/* called with DecommitLock held */
+static size_t takeDecommitRuns(DecommitRun **Runs, size_t *MaxRuns)
+{
+	size_t NumRuns = NumDecommitRuns;
+	*Runs = DecommitRuns;
+	*MaxRuns = MaxDecommitRuns;
+	DecommitRuns = NULL;
+	NumDecommitRuns = MaxDecommitRuns = NumPendingPages = 0;
+	return NumRuns;
+}
+
+static void* decommitThread(void *Arg)
+{
+	DecommitRun *Runs;
+	size_t NumRuns, MaxRuns;
+
+	while (1)
+	{
+		pthread_mutex_lock(&DecommitLock);
+		while (NumDecommitRuns == 0)
+		{
+			pthread_cond_wait(&DecommitCond, &DecommitLock);
+		}
+		NumRuns = takeDecommitRuns(&Runs, &MaxRuns);
+		DecommitBusy = 1;
+		pthread_mutex_unlock(&DecommitLock);
+		decommitRuns(Runs, NumRuns, MaxRuns);
+
+		pthread_mutex_lock(&DecommitLock);
+		DecommitBusy = 0;
+		pthread_cond_broadcast(&DecommitDone);
+		pthread_mutex_unlock(&DecommitLock);
+	}
+	return NULL;
+}
+
+static void startDecommitThread()
+{
+	pthread_t Thread;
+
+	if (pthread_create(&Thread, NULL, decommitThread, NULL) != 0)
+	{
+		printf("unable to create the decommit thread\n");
+		exit(0);
+	}
+}
+
+static void flushDecommits()
+{
+	DecommitRun *Runs;
+	size_t NumRuns, MaxRuns;
+
+	if (DecommitInBackground)
+	{
+		pthread_mutex_lock(&DecommitLock);
+		pthread_cond_signal(&DecommitCond);
+		pthread_mutex_unlock(&DecommitLock);
+		return;
+	}
+	pthread_mutex_lock(&DecommitLock);
+	NumRuns = takeDecommitRuns(&Runs, &MaxRuns);
+	pthread_mutex_unlock(&DecommitLock);
+	decommitRuns(Runs, NumRuns, MaxRuns);
+}
+
+/* freed memory that is about to be handed out again or unmapped must be decommitted first */
+static void syncDecommits()
+{
+	flushDecommits();
+	if (!DecommitInBackground)
+	{
+		return;
+	}
+	pthread_mutex_lock(&DecommitLock);
+	while (NumDecommitRuns > 0 || DecommitBusy)
+	{
+		pthread_cond_wait(&DecommitDone, &DecommitLock);
+	}
+	pthread_mutex_unlock(&DecommitLock);
+}
+
+static void freeBigObject(ObjHeader *Header)
+{
+	assert((Header->Size % PAGE_SIZE) == 0);
+	assert(((ulong64)Header & (PAGE_SIZE-1)) == 0);
+	size_t Size = Header->Size;
+	char *Start = (char*)Header;
+	size_t Iter;
+	for (Iter = 0; Iter < Size; Iter += PAGE_SIZE)
+	{
+		unsigned short *SzMeta = getSizeMetadata((char*)Start + Iter);
+		SzMeta[0] = PAGE_SIZE;
+	}
+	Header->Status = FREE;
+	clearMark(Header);
+	reclaimMemory(Header, Size);
+}
+
+static void freeSmallObject(ObjHeader *Header)
+{
+	unsigned short *SzMeta = getSizeMetadata((char*)Header);
+	SzMeta[0] += Header->Size;
+	assert(SzMeta[0] <= PAGE_SIZE);
+	Header->Status = FREE;
+	clearObjectStart(Header);
+	clearMark(Header);
+	addToFreeList((FreeChunk*)Header);
+	if (SzMeta[0] == PAGE_SIZE)
+	{
+		char *Page = ADDR_TO_PAGE(Header);
+		removePageFromFreeLists(Page);
+		reclaimMemory(Page, PAGE_SIZE);
+	}
+}
+
+static ObjHeader **DeferredFrees = NULL;
+static size_t NumDeferredFrees = 0;
+static size_t MaxDeferredFrees = 0;
+
+static void deferFree(ObjHeader *Header)
+{
+	if (NumDeferredFrees == MaxDeferredFrees)
+	{
+		size_t NewMax = MaxDeferredFrees ? MaxDeferredFrees * 2 : 1024;
+		DeferredFrees = growArray(DeferredFrees, MaxDeferredFrees * sizeof(ObjHeader*), NewMax * sizeof(ObjHeader*));
+		MaxDeferredFrees = NewMax;
+		if (DeferredFrees == NULL)
+		{
+			printf("unable to defer a free\n");
+			exit(0);
+		}
+	}
+	DeferredFrees[NumDeferredFrees++] = Header;
+}
+
+/* called with HeapLock held */
+static void freeObject(ObjHeader *Header)
+{
+	NumBytesFreed += Header->Size;
+	NumObjectsFreed++;
+	if (Header->Size > MAX_SMALL_SIZE)
+	{
+		freeBigObject(Header);
+		addBigExtent((char*)Header, Header->Size);
+	}
+	else
+	{
+		freeSmallObject(Header);
+	}
+}
+
+/* used by the GC to free objects. */
+void myfree(void *Ptr)
+{
+	ObjHeader *Header = (ObjHeader*)((char*)Ptr - OBJ_HEADER_SIZE);
+	assert((Header->Status & FREE) == 0);
+
+	pthread_mutex_lock(&HeapLock);
+	if (MarkingActive)
+	{
+		/* the concurrent marker may be scanning it */
+		deferFree(Header);
+	}
+	else
+	{
+		freeObject(Header);
+	}
+	if (NumPendingPages >= DECOMMIT_BATCH_PAGES)
+	{
+		flushDecommits();
+	}
+	pthread_mutex_unlock(&HeapLock);
+}
+
+/* free the unused end of an allocation buffer */
+static void createHole(char *Start, char *End)
+{
+	size_t HoleSz = End - Start;
+	if (HoleSz > 0)
+	{
+		assert(HoleSz >= 8);
+		ObjHeader *Header = (ObjHeader*)Start;
+		Header->Size = HoleSz;
+		Header->Status = 0;
+		Header->Alignment = 0;
+		freeSmallObject(Header);
+	}
+}
+
+static inline int getAllocSizeBucket(size_t Size)
+{
+	return 63 - __builtin_clzll(Size);
+}
+
+/*
+ * Free extents of the big-object segments. The sweep rebuilds the
+ * index from the size metadata, merging neighbouring free pages, and
+ * myfree adds the extents it frees in between. BigAlloc takes the best
+ * fit from the first bucket that holds one before bumping AllocPtr.
+ */
+static BigExtent *BigExtents[NUM_EXTENT_BUCKETS];
+static size_t NumBigExtents[NUM_EXTENT_BUCKETS];
+static size_t MaxBigExtents[NUM_EXTENT_BUCKETS];
+static Segment *CurBigSeg = NULL;
+static long long NumBigExtentsReused = 0;
+static long long NumBigSegmentsReleased = 0;
+
+static int getExtentBucket(size_t Size)
+{
+	int Bucket = 63 - __builtin_clzll(Size / PAGE_SIZE);
+	return (Bucket < NUM_EXTENT_BUCKETS) ? Bucket : NUM_EXTENT_BUCKETS - 1;
+}
+
+static void addBigExtent(char *Start, size_t Size)
+{
+	int Bucket = getExtentBucket(Size);
+	if (NumBigExtents[Bucket] == MaxBigExtents[Bucket])
+	{
+		size_t NewMax = MaxBigExtents[Bucket] ? MaxBigExtents[Bucket] * 2 : 64;
+		BigExtents[Bucket] = growArray(BigExtents[Bucket], MaxBigExtents[Bucket] * sizeof(BigExtent),
+			NewMax * sizeof(BigExtent));
+		MaxBigExtents[Bucket] = NewMax;
+		if (BigExtents[Bucket] == NULL)
+		{
+			printf("unable to index free big-object pages\n");
+			exit(0);
+		}
+	}
+	BigExtents[Bucket][NumBigExtents[Bucket]].Start = Start;
+	BigExtents[Bucket][NumBigExtents[Bucket]].Size = Size;
+	NumBigExtents[Bucket]++;
+}
+
+/* the remainder of the chosen extent goes back into the index */
+static char* takeBigExtent(size_t Size)
+{
+	int Bucket;
+	for (Bucket = getExtentBucket(Size); Bucket < NUM_EXTENT_BUCKETS; Bucket++)
+	{
+		BigExtent *Extents = BigExtents[Bucket];
+		size_t Best = NumBigExtents[Bucket];
+		size_t Iter;
+
+		for (Iter = 0; Iter < NumBigExtents[Bucket]; Iter++)
+		{
+			if (Extents[Iter].Size >= Size && (Best == NumBigExtents[Bucket] || Extents[Iter].Size < Extents[Best].Size))
+			{
+				Best = Iter;
+				if (Extents[Iter].Size == Size)
+				{
+					break;
+				}
+			}
+		}
+		if (Best == NumBigExtents[Bucket])
+		{
+			continue;
+		}
+		BigExtent Extent = Extents[Best];
+		Extents[Best] = Extents[--NumBigExtents[Bucket]];
+		if (Extent.Size > Size)
+		{
+			addBigExtent(Extent.Start + Size, Extent.Size - Size);
+		}
+		return Extent.Start;
+	}
+	return NULL;
+}
+
+/* called at the end of a sweep, once the freed pages were queued for decommit */
+static void rebuildBigExtents()
+{
+	int SegIdx, Bucket;
+	int Synced = 0;
+
+	for (Bucket = 0; Bucket < NUM_EXTENT_BUCKETS; Bucket++)
+	{
+		NumBigExtents[Bucket] = 0;
+	}
+	for (SegIdx = NumSegments - 1; SegIdx >= 0; SegIdx--)
+	{
+		Segment *Seg = Segments[SegIdx];
+		char *AllocPtr = getAllocPtr(Seg);
+		char *Page = getDataPtr(Seg);
+		char *Run = NULL;
+
+		if (!getBigAlloc(Seg))
+		{
+			continue;
+		}
+		while (Page < AllocPtr)
+		{
+			if (getSizeMetadata(Page)[0] == PAGE_SIZE)
+			{
+				Run = Run ? Run : Page;
+				Page += PAGE_SIZE;
+				continue;
+			}
+			if (Run)
+			{
+				addBigExtent(Run, Page - Run);
+				Run = NULL;
+			}
+			Page += ((ObjHeader*)Page)->Size;
+		}
+		if (Run == NULL)
+		{
+			continue;
+		}
+		if (Run != getDataPtr(Seg) || Seg == CurBigSeg)
+		{
+			addBigExtent(Run, AllocPtr - Run);
+			continue;
+		}
+
+		/* nothing lives in the segment any more */
+		if (!Synced)
+		{
+			syncDecommits();
+			Synced = 1;
+		}
+		removeFromSegmentTable(SegIdx);
+		if (munmap(Seg->Other.MapBase, SEGMENT_SIZE * 2) == -1)
+		{
+			printf("unable to unmap a segment\n");
+			exit(0);
+		}
+		NumBigSegmentsReleased++;
+	}
+}
+
+static void* BigAlloc(size_t Size)
+{
+	size_t AlignedSize = Align(Size + OBJ_HEADER_SIZE, PAGE_SIZE);
+	NumBytesAllocated += AlignedSize;
+	if (CountAllocSizes)
+	{
+		AllocSizeHistogram[getAllocSizeBucket(AlignedSize)]++;
+	}
+	checkAndRunGC(AlignedSize);
+	assert(AlignedSize <= SEGMENT_SIZE - METADATA_SIZE);
+	char *AllocPtr = takeBigExtent(AlignedSize);
+	size_t Iter;
+
+	if (AllocPtr)
+	{
+		/* the pages may still be queued for decommit */
+		syncDecommits();
+		allowAccess(AllocPtr, AlignedSize);
+		/* only MADV_DONTNEED is sure to have dropped the old contents */
+		if (DecommitLazily || HugePages)
+		{
+			memset(AllocPtr, 0, AlignedSize);
+		}
+		NumBigExtentsReused++;
+	}
+	else
+	{
+		if (CurBigSeg == NULL || getAllocPtr(CurBigSeg) + AlignedSize > getReservePtr(CurBigSeg))
+		{
+			CurBigSeg = allocateSegment(1);
+		}
+		AllocPtr = getAllocPtr(CurBigSeg);
+		char *CommitPtr = getCommitPtr(CurBigSeg);
+		char *NewAllocPtr = AllocPtr + AlignedSize;
+		char *ReservePtr = getReservePtr(CurBigSeg);
+		if (NewAllocPtr > CommitPtr)
+		{
+			/* with huge pages the tail of the last one is committed for the next objects */
+			char *NewCommitPtr = HugePages ? (char*)Align((ulong64)NewAllocPtr, HUGE_PAGE_SIZE) : NewAllocPtr;
+			NewCommitPtr = (NewCommitPtr < ReservePtr) ? NewCommitPtr : ReservePtr;
+			/* big objects are only marked through the bitmap */
+			commitBitmap(CurBigSeg, NewCommitPtr);
+			allowAccess(CommitPtr, NewCommitPtr - CommitPtr);
+			setCommitPtr(CurBigSeg, NewCommitPtr);
+		}
+		setAllocPtr(CurBigSeg, NewAllocPtr);
+	}
+
+	unsigned short *SzMeta = getSizeMetadata(AllocPtr);
+	SzMeta[0] = 1;
+	for (Iter = PAGE_SIZE; Iter < AlignedSize; Iter += PAGE_SIZE)
+	{
+		/* a reused extent was marked free page by page */
+		getSizeMetadata(AllocPtr + Iter)[0] = 0;
+	}
+
+	ObjHeader *Header = (ObjHeader*)AllocPtr;
+	Header->Size = AlignedSize;
+	Header->Status = 0;
+	Header->Alignment = 0;
+	Header->Type = 0;
+	if (MarkingActive)
+	{
+		setMarkAtomic(Header);
+	}
+	return AllocPtr + OBJ_HEADER_SIZE;
+}
 
 
 /************************************************************************************************
- * 							adds new node at the end of list i.e. tail 							*
+ * Threads.																						*
+ * A thread is registered on its first allocation (or by GCRegisterThread) and unregistered	*
+ * when it exits. The collecting thread stops the others with SIG_SUSPEND: the handler			*
+ * records the top of the stack, whose signal frame holds the interrupted registers, 			*
+ * acknowledges and waits for SIG_RESUME. A thread interrupted while bump-allocating			*
+ * finishes the object first and then suspends itself, saving its callee-saved registers		*
+ * with setjmp. Every buffer is retired while the world is stopped, so the collector only		*
+ * sees formatted pages.																		*
  ************************************************************************************************/
-void addToUnscannedList(unsigned char *objHeader) {
-	
-	UnscannedList *node = (UnscannedList*)malloc(sizeof(UnscannedList));
-	if (node == NULL) {
-		printf("Unable to allocate list node\n");
+static GCThread *Threads = NULL;
+static __thread GCThread *Self __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_once_t ThreadsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ThreadKey;
+static sem_t SuspendAck;
+static volatile sig_atomic_t WorldStopped = 0;
+
+static void suspendSelf()
+{
+	jmp_buf Regs;
+	sigset_t Blocked, Saved, Wait;
+	int SavedErrno = errno;
+
+	sigemptyset(&Blocked);
+	sigaddset(&Blocked, SIG_SUSPEND);
+	sigaddset(&Blocked, SIG_RESUME);
+	pthread_sigmask(SIG_BLOCK, &Blocked, &Saved);
+
+	/* registers not spilled by the interrupted code may hold the only reference */
+	setjmp(Regs);
+	Self->StackTop = (char*)&Regs;
+	sem_post(&SuspendAck);
+
+	sigfillset(&Wait);
+	sigdelset(&Wait, SIG_RESUME);
+	while (WorldStopped)
+	{
+		sigsuspend(&Wait);
+	}
+	Self->StackTop = NULL;
+	sem_post(&SuspendAck);
+
+	pthread_sigmask(SIG_SETMASK, &Saved, NULL);
+	errno = SavedErrno;
+}
+
+static void suspendHandler(int Sig)
+{
+	if (Self == NULL)
+	{
+		return;
+	}
+	if (Self->InAlloc)
+	{
+		Self->SuspendPending = 1;
+		return;
+	}
+	suspendSelf();
+}
+
+static void resumeHandler(int Sig)
+{
+}
+
+static void threadExit(void *Arg);
+
+static void initThreads()
+{
+	struct sigaction Act;
+
+	memset(&Act, 0, sizeof(Act));
+	Act.sa_flags = SA_RESTART;
+	Act.sa_handler = suspendHandler;
+	sigemptyset(&Act.sa_mask);
+	sigaddset(&Act.sa_mask, SIG_RESUME);
+	if (sigaction(SIG_SUSPEND, &Act, NULL) != 0)
+	{
+		printf("unable to install the suspend handler\n");
+		exit(0);
+	}
+	Act.sa_handler = resumeHandler;
+	sigemptyset(&Act.sa_mask);
+	if (sigaction(SIG_RESUME, &Act, NULL) != 0)
+	{
+		printf("unable to install the resume handler\n");
+		exit(0);
+	}
+	if (sem_init(&SuspendAck, 0, 0) != 0 || pthread_key_create(&ThreadKey, threadExit) != 0)
+	{
+		printf("unable to initialize thread support\n");
+		exit(0);
+	}
+}
+
+static GCThread* registerThread()
+{
+	pthread_attr_t Attr;
+	void *Base;
+	size_t Size;
+
+	pthread_once(&ThreadsOnce, initThreads);
+	GCThread *Thread = calloc(1, sizeof(GCThread));
+	if (Thread == NULL)
+	{
+		printf("unable to register a thread\n");
+		exit(0);
+	}
+	if (pthread_getattr_np(pthread_self(), &Attr) != 0 ||
+		pthread_attr_getstack(&Attr, &Base, &Size) != 0)
+	{
+		printf("Error getting stackinfo\n");
 		exit(0);
 	}
-	node -> next = NULL;
-	node -> objHeader = objHeader;
+	pthread_attr_destroy(&Attr);
+	Thread->Thread = pthread_self();
+	Thread->StackBottom = (char*)Base + Size;
+
+	/* set before the thread is visible, a collection may signal it right away */
+	Self = Thread;
+	pthread_setspecific(ThreadKey, Thread);
+	pthread_mutex_lock(&HeapLock);
+	Thread->Next = Threads;
+	Threads = Thread;
+	pthread_mutex_unlock(&HeapLock);
+	return Thread;
+}
+
+static void flushTlabStats(GCThread *Thread)
+{
+	int Bucket;
+
+	if (CountAllocSizes)
+	{
+		for (Bucket = 0; Bucket < NUM_ALLOC_SIZE_BUCKETS; Bucket++)
+		{
+			AllocSizeHistogram[Bucket] += Thread->AllocSizes[Bucket];
+			Thread->AllocSizes[Bucket] = 0;
+		}
+	}
+	NumBytesAllocated += Thread->TlabBytes;
+	BytesSinceGC += Thread->TlabBytes;
+	if (Thread->TlabFromList)
+	{
+		NumFreeListHits += Thread->TlabObjects;
+	}
+	else
+	{
+		NumFreeListMisses += Thread->TlabObjects;
+	}
+	Thread->TlabBytes = 0;
+	Thread->TlabObjects = 0;
+}
+
+static void retireTlab(GCThread *Thread)
+{
+	flushTlabStats(Thread);
+	if (Thread->TlabPtr)
+	{
+		createHole(Thread->TlabPtr, Thread->TlabEnd);
+		Thread->TlabPtr = Thread->TlabEnd = NULL;
+	}
+}
+
+static void unregisterThread(GCThread *Thread)
+{
+	GCThread **Link;
+
+	pthread_mutex_lock(&HeapLock);
+	retireTlab(Thread);
+	flushSATBBuffer(Thread);
+	for (Link = &Threads; *Link != Thread; Link = &(*Link)->Next);
+	*Link = Thread->Next;
+	pthread_mutex_unlock(&HeapLock);
+	free(Thread);
+}
+
+static void threadExit(void *Arg)
+{
+	unregisterThread((GCThread*)Arg);
+	Self = NULL;
+}
+
+void GCRegisterThread()
+{
+	if (Self == NULL)
+	{
+		registerThread();
+	}
+}
+
+void GCUnregisterThread()
+{
+	if (Self)
+	{
+		pthread_setspecific(ThreadKey, NULL);
+		unregisterThread(Self);
+		Self = NULL;
+	}
+}
+
+static void signalThreads(int Sig)
+{
+	GCThread *Thread;
+	int NumSignaled = 0;
+
+	for (Thread = Threads; Thread; Thread = Thread->Next)
+	{
+		if (Thread == Self)
+		{
+			continue;
+		}
+		if (pthread_kill(Thread->Thread, Sig) != 0)
+		{
+			printf("unable to signal a thread\n");
+			exit(0);
+		}
+		NumSignaled++;
+	}
+	while (NumSignaled > 0)
+	{
+		if (sem_wait(&SuspendAck) == 0)
+		{
+			NumSignaled--;
+		}
+	}
+}
+
+/* called with HeapLock held */
+static void stopWorld()
+{
+	WorldStopped = 1;
+	signalThreads(SIG_SUSPEND);
+}
+
+static void startWorld()
+{
+	WorldStopped = 0;
+	signalThreads(SIG_RESUME);
+}
+
+/* the next buffer: a hole from the free lists if one fits, otherwise a fresh page */
+static void refillTlab(GCThread *Thread, size_t AlignedSize)
+{
+	retireTlab(Thread);
+	checkAndRunGC(0);
+
+	FreeChunk *Chunk = takeFreeChunk(AlignedSize);
+	while (Chunk == NULL && sweepNextUnit())
+	{
+		/* lazy sweeping: reclaim holes only as they are needed */
+		NumLazySweepUnits++;
+		Chunk = takeFreeChunk(AlignedSize);
+	}
+	if (NumPendingPages >= DECOMMIT_BATCH_PAGES)
+	{
+		flushDecommits();
+	}
+	Thread->AllocBlack = MarkingActive;
+	if (Chunk)
+	{
+		Thread->TlabPtr = (char*)Chunk;
+		Thread->TlabEnd = (char*)Chunk + Chunk->Size;
+		Thread->TlabFromList = 1;
+		return;
+	}
+
+	Thread->TlabPtr = takeFreshPage();
+	Thread->TlabEnd = Thread->TlabPtr + PAGE_SIZE;
+	Thread->TlabFromList = 0;
+}
+
+static void* allocFromTlab(GCThread *Thread, size_t AlignedSize)
+{
+	void *Obj = NULL;
+	char *Ptr;
+
+	Thread->InAlloc = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	Ptr = Thread->TlabPtr;
+	if ((size_t)(Thread->TlabEnd - Ptr) >= AlignedSize)
+	{
+		ObjHeader *Header = (ObjHeader*)Ptr;
+		Thread->TlabPtr = Ptr + AlignedSize;
+		Thread->TlabBytes += AlignedSize;
+		Thread->TlabObjects++;
+		if (CountAllocSizes)
+		{
+			Thread->AllocSizes[getAllocSizeBucket(AlignedSize)]++;
+		}
+		/* a hole still holds the bytes of the objects that died in it; fresh pages are zero */
+		if (Thread->TlabFromList)
+		{
+			memset(Ptr + OBJ_HEADER_SIZE, 0, AlignedSize - OBJ_HEADER_SIZE);
+		}
+		/* marked before it becomes visible to the concurrent marker */
+		if (Thread->AllocBlack)
+		{
+			setMarkAtomic(Header);
+		}
+		setObjectStart(Header);
+		Header->Size = AlignedSize;
+		Header->Status = 0;
+		Header->Alignment = 0;
+		Header->Type = 0;
+		Obj = Ptr + OBJ_HEADER_SIZE;
+	}
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	Thread->InAlloc = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (Thread->SuspendPending)
+	{
+		Thread->SuspendPending = 0;
+		suspendSelf();
+	}
+	return Obj;
+}
+
+/*
+ * called by mymalloc in mem.s before it spills any register. A request
+ * the thread's buffer can satisfy never starts a collection, so the
+ * registers need not be made visible to the marker; NULL sends the
+ * request down the slow path.
+ */
+void *_mymallocFast(size_t Size)
+{
+	size_t AlignedSize = Align(Size, 8) + OBJ_HEADER_SIZE;
+	GCThread *Thread = Self;
+
+	if (Thread == NULL || Size == 0 || AlignedSize > MAX_SMALL_SIZE)
+	{
+		return NULL;
+	}
+	return allocFromTlab(Thread, AlignedSize);
+}
+
+void *_mymalloc(size_t Size)
+{
+	size_t AlignedSize = Align(Size, 8) + OBJ_HEADER_SIZE;
+	GCThread *Thread = Self;
+	void *Obj;
+
+	assert(Size != 0);
+	assert(sizeof(struct OtherMetadata) <= OTHER_METADATA_SIZE);
+	assert(sizeof(struct Segment) == METADATA_SIZE);
+
+	if (Thread == NULL)
+	{
+		Thread = registerThread();
+	}
+	if (AlignedSize <= MAX_SMALL_SIZE)
+	{
+		Obj = allocFromTlab(Thread, AlignedSize);
+		if (Obj)
+		{
+			return Obj;
+		}
+	}
+
+	pthread_mutex_lock(&HeapLock);
+	if (AlignedSize > MAX_SMALL_SIZE)
+	{
+		Obj = BigAlloc(Size);
+	}
+	else
+	{
+		refillTlab(Thread, AlignedSize);
+		Obj = allocFromTlab(Thread, AlignedSize);
+	}
+	pthread_mutex_unlock(&HeapLock);
+	return Obj;
+}
+
+
+static GCWorker SerialMarker;
+static GCWorker GCWorkers[MAX_GC_THREADS];
+static GCWorker ConcMarker;
+
+static MarkStackChunk* allocateMarkStackChunk(MarkStack *Stack)
+{
+	MarkStackChunk *Chunk = Stack->Spare;
+	if (Chunk)
+	{
+		Stack->Spare = NULL;
+		return Chunk;
+	}
+	if (Stack->NumChunks >= MaxMarkStackChunks)
+	{
+		return NULL;
+	}
+	Chunk = mmap(NULL, MARK_STACK_CHUNK_SIZE, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (Chunk == MAP_FAILED)
+	{
+		return NULL;
+	}
+	Stack->NumChunks++;
+	return Chunk;
+}
+
+/*
+ * If the stack can not grow the object is dropped; it is already
+ * marked, so rescanMarkedObjects() will find it later.
+ */
+static inline void pushMarkStack(MarkStack *Stack, ObjHeader *Header)
+{
+	if (Stack->Chunk == NULL || Stack->Top == MARK_STACK_CHUNK_ENTRIES)
+	{
+		MarkStackChunk *Chunk = allocateMarkStackChunk(Stack);
+		if (Chunk == NULL)
+		{
+			Stack->Overflow = 1;
+			return;
+		}
+		Chunk->Prev = Stack->Chunk;
+		Stack->Chunk = Chunk;
+		Stack->Top = 0;
+	}
+	Stack->Chunk->Entries[Stack->Top++] = Header;
+}
+
+static inline ObjHeader* popMarkStack(MarkStack *Stack)
+{
+	if (Stack->Chunk == NULL)
+	{
+		return NULL;
+	}
+	if (Stack->Top == 0)
+	{
+		MarkStackChunk *Empty = Stack->Chunk;
+		Stack->Chunk = Empty->Prev;
+		if (Stack->Spare)
+		{
+			munmap(Stack->Spare, MARK_STACK_CHUNK_SIZE);
+			Stack->NumChunks--;
+		}
+		Stack->Spare = Empty;
+		if (Stack->Chunk == NULL)
+		{
+			return NULL;
+		}
+		Stack->Top = MARK_STACK_CHUNK_ENTRIES;
+	}
+	return Stack->Chunk->Entries[--Stack->Top];
+}
+
+
+/************************************************************************************************
+ * Sweep a small-object page up to End (the page end or AllocPtr of the current page).			*
+ * Unmarked objects are freed and coalesced with neighbouring holes into maximal free runs,	*
+ * which go to the segregated free lists unless the whole page became free, in which case	*
+ * the page is reclaimed instead.																*
+ ************************************************************************************************/
+static void sweepSmallPage(char *Page, char *End, SweepContext *Ctx)
+{
+	unsigned short *SzMeta = getSizeMetadata(Page);
+	FreeChunk *Run = NULL;
+	char *Ptr = Page;
+	ulong64 Bit;
+	ulong64 *Starts = getBitmapWord(Page, &Bit);
+	ulong64 *Marks = getMarkWord(Page, &Bit);
+	int Iter;
+
+	if (End == Page + PAGE_SIZE)
+	{
+		/* pages without garbage or without survivors need no walk */
+		ulong64 Live = 0, Dead = 0;
+		for (Iter = 0; Iter < BITMAP_WORDS_PER_PAGE; Iter++)
+		{
+			Live |= Marks[Iter];
+			Dead |= Starts[Iter] & ~Marks[Iter];
+		}
+		if (Dead == 0 && SzMeta[0] == 0)
+		{
+			return;
+		}
+		/* with lazy sweeping the page may hold chunks listed by myfree */
+		if (Live == 0 && !LazySweep)
+		{
+			for (Iter = 0; Iter < BITMAP_WORDS_PER_PAGE; Iter++)
+			{
+				Ctx->ObjectsFreed += __builtin_popcountll(Starts[Iter]);
+			}
+			Ctx->BytesFreed += PAGE_SIZE - SzMeta[0];
+			memset(Starts, 0, BITMAP_WORDS_PER_PAGE * sizeof(ulong64));
+			SzMeta[0] = PAGE_SIZE;
+			reclaimMemory(Page, PAGE_SIZE);
+			return;
+		}
+	}
+
+	while (Ptr < End)
+	{
+		ObjHeader *Header = (ObjHeader*)Ptr;
+		Ptr += Header->Size;
+
+		if (Header->Status != FREE && isMarked(Header))
+		{
+			/* object is reachable so cannot be freed */
+			if (Run)
+			{
+				addToSweepContext(Ctx, Run);
+				Run = NULL;
+			}
+			continue;
+		}
+		if (Header->Status == FREE)
+		{
+			if (isListedChunk((FreeChunk*)Header))
+			{
+				removeFromFreeList((FreeChunk*)Header);
+			}
+		}
+		else
+		{
+			/* object is not reachable, so free it */
+			Ctx->BytesFreed += Header->Size;
+			Ctx->ObjectsFreed++;
+			SzMeta[0] += Header->Size;
+			Header->Status = FREE;
+			clearObjectStart(Header);
+		}
+
+		if (Run == NULL)
+		{
+			Run = (FreeChunk*)Header;
+		}
+		else
+		{
+			Run->Size += Header->Size;
+		}
+	}
+
+	assert(SzMeta[0] <= PAGE_SIZE);
+	if (SzMeta[0] == PAGE_SIZE)
+	{
+		reclaimMemory(Page, PAGE_SIZE);
+	}
+	else if (Run)
+	{
+		addToSweepContext(Ctx, Run);
+	}
+}
+
+/************************************************************************************************
+ * Idea:																						*
+ * 		Since myfree stores the amount of memory free for each page, we can use it to know 		*
+ *		whether current page is free or not. If free, then move to next page. Otherwise, 		*
+ *		small-object pages are swept as a whole by sweepSmallPage(), while in big-object 		*
+ *		segments the start of the page contains the objectHeader and using that we will free 	*
+ *		the object depending on its mark bit and move to next Header using the size of object	*
+ *		stored in current objectHeader.															*
+ ************************************************************************************************/
+static void sweepUnit(SweepUnit *unit, SweepContext *ctx) {
+
+	char *startptr = unit -> Start;
+	char *endptr = unit -> End;
+
+	while(startptr < endptr) {
+		
+		if (getSizeMetadata(ADDR_TO_PAGE(startptr))[0] == PAGE_SIZE) {
+			startptr = ADDR_TO_PAGE(startptr) + PAGE_SIZE;		// page is already free, go to next page
+		}
+		else if (!unit -> BigAlloc) {
+			char *pageEnd = startptr + PAGE_SIZE;
+			sweepSmallPage(startptr, pageEnd < endptr ? pageEnd : endptr, ctx);
+			startptr = pageEnd;
+		}
+		else {
+			
+			ObjHeader *objHeader = (ObjHeader*)(startptr);
+			startptr += objHeader -> Size;						// cannot be done later since page might be freed
+			
+			if(objHeader -> Status == 0 && !isMarked(objHeader)){	// object is not reachable, so free it
+				ctx -> BytesFreed += objHeader -> Size;
+				ctx -> ObjectsFreed++;
+				freeBigObject(objHeader);
+			}
+		}
+	}
+}
+
+
+/************************************************************************************************
+ * returns whether address lies in between Data Ptr and Alloc Ptr of some segment 				*
+ ************************************************************************************************/
+static inline int isPresentInSegmentTable(char *addr) {
+
+	if ((ulong64)addr - HeapMin > HeapMax - HeapMin)	// outside every segment (also handles addr < HeapMin)
+		return 0;
+
+	Segment *seg = SegmentTable[ADDR_TO_SEGMENT_INDEX(addr)];
+	return seg && getDataPtr(seg) <= addr && addr <= getAllocPtr(seg);
+}
+
+/************************************************************************************************
+ * returns: objectHeader corresponding to the object's reference stored in pointer: char *addr 	*
+ *			returns NULL for invalid addresses 													*
+ * Idea: 				 				 				 										*
+ * 		Object's size >  PAGE_SIZE:  				 											*
+ * 			"The metadata corresponding to the first page of a big allocation is set to one to 	*
+ * 			identify the first byte of these objects." Interior pages of a live big object 		*
+ * 			have zero in their metadata, so we walk back from the page containing addr until 	*
+ * 			we reach the first page, whose top stores the objectHeader. Hitting a free page 	*
+ * 			(PAGE_SIZE) first means addr points into a freed object.							*
+ *		Object's size <= PAGE_SIZE:																*
+ * 			Allocation sets the bit of every object header in the segment's object-start 		*
+ * 			bitmap. The header of the object containing addr is the closest set bit at or		*
+ * 			below addr within its page, which is found with a few word-sized scans.	A pointer	*
+ * 			just past the end of an object (which is also the next object's header) still		*
+ * 			refers to the earlier object.														*
+ ************************************************************************************************/
+ObjHeader* getObjectHeader(char *addr) {
+
+	if(isPresentInSegmentTable(addr) == 0)
+		return NULL;
+
+	if (getBigAlloc(ADDR_TO_SEGMENT(addr))) {	/* Find objectHeader for bigAlloc */
+
+		char *myPage = ADDR_TO_PAGE(addr);
+		unsigned short szMeta;
+		// iterate until first page of bigAlloc is reached
+		while ((szMeta = getSizeMetadata(myPage)[0]) == 0) myPage -= PAGE_SIZE;
+		// return objectHeader if application contained reference 
+		// to object and not to its header(i.e >= mypage + 16)
+		if (szMeta == 1 && myPage + OBJ_HEADER_SIZE <= addr)
+			return (ObjHeader*)myPage;
+	}
+	else {										/* Find object header for smallAlloc*/
+
+		char *page = ADDR_TO_PAGE(addr);
+		ObjHeader *objHeader = findObjectStart(addr);
+
+		if (objHeader == NULL)
+			return NULL;
+
+		if ((char*)objHeader == addr) {									// may be one past the end of previous object
+			if (addr == page)
+				return NULL;
+			objHeader = findObjectStart(addr - 1);
+			if (objHeader && (char*)objHeader + objHeader -> Size == addr)
+				return objHeader;
+			return NULL;
+		}
+
+		if (addr < (char*)objHeader + OBJ_HEADER_SIZE)					// application contains reference to header and not object
+			return NULL;
+
+		if (addr <= (char*)objHeader + objHeader -> Size)
+			return objHeader;
+	}
+	return NULL;
+}
+
+/* write barrier of the generational mode: dirty the cards of a store into the heap */
+void GCRecordWrite(void *Addr, size_t Size)
+{
+	char *Ptr = (char*)Addr;
+	char *Last = Ptr + (Size ? Size - 1 : 0);
+
+	if (!Generational || !isPresentInSegmentTable(Ptr))
+	{
+		return;
+	}
+	*getCard(Ptr) = 1;
+	if (getCard(Last) != getCard(Ptr) && isPresentInSegmentTable(Last))
+	{
+		*getCard(Last) = 1;
+	}
+}
+
+
+/*
+ * Old values logged by the snapshot barrier. Each thread fills its own
+ * buffer and hands it over to SATBQueue when it is full; the remark
+ * pause takes whatever is left in the buffers of the stopped threads.
+ */
+static pthread_mutex_t SATBLock = PTHREAD_MUTEX_INITIALIZER;
+static ulong64 *SATBQueue = NULL;
+static size_t NumSATBEntries = 0;
+static size_t MaxSATBEntries = 0;
+
+/* called with SATBLock held */
+static void appendSATBQueue(ulong64 *Values, size_t Num)
+{
+	if (NumSATBEntries + Num > MaxSATBEntries)
+	{
+		size_t NewMax = MaxSATBEntries ? MaxSATBEntries * 2 : 4 * SATB_BUFFER_SIZE;
+		while (NewMax < NumSATBEntries + Num)
+		{
+			NewMax *= 2;
+		}
+		SATBQueue = growArray(SATBQueue, MaxSATBEntries * sizeof(ulong64), NewMax * sizeof(ulong64));
+		if (SATBQueue == NULL)
+		{
+			printf("unable to grow the SATB queue\n");
+			exit(0);
+		}
+		MaxSATBEntries = NewMax;
+	}
+	memcpy(SATBQueue + NumSATBEntries, Values, Num * sizeof(ulong64));
+	NumSATBEntries += Num;
+}
+
+static void flushSATBBuffer(GCThread *Thread)
+{
+	pthread_mutex_lock(&SATBLock);
+	appendSATBQueue(Thread->SATBBuffer, Thread->SATBCount);
+	Thread->SATBCount = 0;
+	pthread_mutex_unlock(&SATBLock);
+}
+
+/*
+ * snapshot-at-the-beginning barrier, called by the instrumented code
+ * before every store while a concurrent mark is running: the values
+ * about to be overwritten were reachable when marking started, so they
+ * must be marked even if the marker never sees them in the heap.
+ * Stores to globals and stacks need no logging, the remark pause
+ * rescans those.
+ */
+void GCPreWrite(void *Addr, size_t Size)
+{
+	GCThread *Thread = Self;
+	ulong64 *Word = (ulong64*)((ulong64)Addr & ~7ULL);
+	ulong64 *Last = (ulong64*)(((ulong64)Addr + (Size ? Size - 1 : 0)) & ~7ULL);
+
+	if (!MarkingActive || !isPresentInSegmentTable((char*)Word))
+	{
+		return;
+	}
+	for (; Word <= Last; Word++)
+	{
+		ulong64 Value = *Word;
+		if (!isPresentInSegmentTable((char*)Value))
+		{
+			continue;
+		}
+		if (Thread == NULL)
+		{
+			pthread_mutex_lock(&SATBLock);
+			appendSATBQueue(&Value, 1);
+			pthread_mutex_unlock(&SATBLock);
+			continue;
+		}
+		if (Thread->SATBCount == SATB_BUFFER_SIZE)
+		{
+			flushSATBBuffer(Thread);
+		}
+		Thread->SATBBuffer[Thread->SATBCount] = Value;
+		Thread->SATBCount++;
+	}
+}
+
+/*
+ * size the next allocation budget from what the marker found live: the
+ * heap may grow by GCGrowthPercent of the live bytes before the next
+ * collection, clamped to [GCMinTrigger, GCMaxTrigger].
+ */
+static void updateGCTrigger(int Minor)
+{
+	/* a minor collection only marks what survived of the objects allocated since the last one */
+	long long HeapBytes = Minor ? BytesSinceGC : NumBytesAllocated - NumBytesFreed;
+	long long Marked = SerialMarker.MarkedBytes + ConcMarker.MarkedBytes;
+	int Iter;
+
+	SerialMarker.MarkedBytes = 0;
+	ConcMarker.MarkedBytes = 0;
+	for (Iter = 0; Iter < MAX_GC_THREADS; Iter++)
+	{
+		Marked += GCWorkers[Iter].MarkedBytes;
+		GCWorkers[Iter].MarkedBytes = 0;
+	}
+	LiveBytes = Minor ? LiveBytes + Marked : Marked;
+	LastMarkedBytes = Marked;
+
+	SurvivalLast = (HeapBytes > 0) ? (double)Marked / HeapBytes : 0;
+	SurvivalLast = (SurvivalLast > 1) ? 1 : SurvivalLast;
+	SurvivalTotal += SurvivalLast;
+	SurvivalMin = (SurvivalLast < SurvivalMin) ? SurvivalLast : SurvivalMin;
+	SurvivalMax = (SurvivalLast > SurvivalMax) ? SurvivalLast : SurvivalMax;
+
+	long long Trigger = LiveBytes / 100 * GCGrowthPercent;
+	Trigger = (Trigger < GCMinTrigger) ? GCMinTrigger : Trigger;
+	Trigger = (Trigger > GCMaxTrigger) ? GCMaxTrigger : Trigger;
+	GCTrigger = Trigger;
+}
+
+static double getTimeMs()
+{
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec * 1e3 + Ts.tv_nsec / 1e6;
+}
+
+static void initWorkDeque(WorkDeque *Deque)
+{
+	Deque->Buffer = mmap(NULL, WORK_DEQUE_SIZE * sizeof(ObjHeader*), PROT_READ|PROT_WRITE,
+		MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (Deque->Buffer == MAP_FAILED)
+	{
+		printf("unable to allocate a mark deque\n");
+		exit(0);
+	}
+	Deque->Top = Deque->Bottom = 0;
+}
+
+/* owner only; fails when the deque is full */
+static inline int pushWorkDeque(WorkDeque *Deque, ObjHeader *Header)
+{
+	long Bottom = Deque->Bottom;
+	long Top = __atomic_load_n(&Deque->Top, __ATOMIC_ACQUIRE);
+
+	if (Bottom - Top >= (long)WORK_DEQUE_SIZE)
+	{
+		return 0;
+	}
+	Deque->Buffer[Bottom & (WORK_DEQUE_SIZE - 1)] = Header;
+	__atomic_store_n(&Deque->Bottom, Bottom + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* owner only */
+static inline ObjHeader* popWorkDeque(WorkDeque *Deque)
+{
+	long Bottom = Deque->Bottom - 1;
+	__atomic_store_n(&Deque->Bottom, Bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long Top = __atomic_load_n(&Deque->Top, __ATOMIC_RELAXED);
+
+	if (Top > Bottom)
+	{
+		__atomic_store_n(&Deque->Bottom, Bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	ObjHeader *Header = Deque->Buffer[Bottom & (WORK_DEQUE_SIZE - 1)];
+	if (Top == Bottom)
+	{
+		/* last entry: race against thieves for it */
+		if (!__atomic_compare_exchange_n(&Deque->Top, &Top, Top + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		{
+			Header = NULL;
+		}
+		__atomic_store_n(&Deque->Bottom, Bottom + 1, __ATOMIC_RELAXED);
+	}
+	return Header;
+}
+
+/* any marker; returns NULL when empty or when another thief won */
+static inline ObjHeader* stealWorkDeque(WorkDeque *Deque)
+{
+	long Top = __atomic_load_n(&Deque->Top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long Bottom = __atomic_load_n(&Deque->Bottom, __ATOMIC_ACQUIRE);
+
+	if (Top >= Bottom)
+	{
+		return NULL;
+	}
+	ObjHeader *Header = Deque->Buffer[Top & (WORK_DEQUE_SIZE - 1)];
+	if (!__atomic_compare_exchange_n(&Deque->Top, &Top, Top + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	{
+		return NULL;
+	}
+	return Header;
+}
+
+static inline int isWorkDequeEmpty(WorkDeque *Deque)
+{
+	return __atomic_load_n(&Deque->Top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&Deque->Bottom, __ATOMIC_ACQUIRE);
+}
+
+static inline void pushGrey(GCWorker *Marker, ObjHeader *Header)
+{
+	if (Marker->Parallel && pushWorkDeque(&Marker->Deque, Header))
+	{
+		return;
+	}
+	pushMarkStack(&Marker->Stack, Header);
+}
+
+static inline ObjHeader* popGrey(GCWorker *Marker)
+{
+	ObjHeader *Header;
+	if (Marker->Parallel && (Header = popWorkDeque(&Marker->Deque)))
+	{
+		return Header;
+	}
+	return popMarkStack(&Marker->Stack);
+}
+
+/************************************************************************************************
+ * mark the object referenced by a candidate pointer and queue it for scanning if it is a 	*
+ * valid, unmarked object. The mark lives in the segment's mark bitmap, not in the header;	*
+ * parallel markers claim the object with an atomic OR on its mark word, so each object is 	*
+ * scanned by exactly one marker.																*
+ ************************************************************************************************/
+static inline void markCandidate(GCWorker *marker, char *valueAtAddr) {
+
+	ObjHeader *objHeader = getObjectHeader(valueAtAddr);
+	ulong64 bit;
+
+	if (objHeader == NULL)										// not an object
+		return;
+
+	ulong64 *markWord = getMarkWord((char*)objHeader, &bit);
+	if (*markWord & bit)										// already marked
+		return;
+
+	if (marker -> Parallel) {
+		if (__atomic_fetch_or(markWord, bit, __ATOMIC_RELAXED) & bit)
+			return;												// another marker claimed it
+	}
+	else
+		*markWord |= bit;
+	marker -> MarkedBytes += objHeader -> Size;
+	pushGrey(marker, objHeader);
+}
+
+/* the first metadata touched when resolving a candidate pointer */
+static inline void prefetchCandidate(ulong64 Value)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Value);
+	ulong64 Granule = (Value - (ulong64)Seg) / GRANULE_SIZE;
+	__builtin_prefetch(&SegmentTable[ADDR_TO_SEGMENT_INDEX(Value)]);
+	__builtin_prefetch(&Seg->StartBitmap[Granule / 64]);
+	__builtin_prefetch(&Seg->MarkBitmap[Granule / 64]);
+}
+
+/************************************************************************************************ 
+ * compatibility mode: walk all addresses in the range [Top, Bottom-8], 8 bytes at each byte	*
+ * offset.																						*
+ ************************************************************************************************/
+static void scanRootsUnaligned(GCWorker *marker, unsigned char *Top, unsigned char *Bottom) {	// top < bottom	
+	
+	Bottom -= 8;
+	for (unsigned char *addr = Top ; addr <= Bottom ;  addr++)
+		markCandidate(marker, (char*)(*((ulong64*)addr)));
+}
+
+/************************************************************************************************ 
+ * walk all 8-byte aligned words in the range [Top, Bottom).									*
+ * Words are checked against the heap's address range SCAN_BATCH at a time with vector		*
+ * compares; the metadata of the surviving candidates is prefetched before any of them is	*
+ * resolved, so the lookups of one batch overlap.												*
+ * add unmarked valid objects to the marker's grey objects after marking them for scanning.	*
+ ************************************************************************************************/
+typedef ulong64 ScanVec __attribute__((vector_size(SCAN_BATCH * sizeof(ulong64)), aligned(sizeof(ulong64))));
+
+static void scanRoots(GCWorker *marker, unsigned char *Top, unsigned char *Bottom) {	// top < bottom	
+
+	if (UnalignedScan) {
+		scanRootsUnaligned(marker, Top, Bottom);
+		return;
+	}
+
+	ulong64 *word = (ulong64*)Align((ulong64)Top, sizeof(ulong64));
+	ulong64 *end = (ulong64*)((ulong64)Bottom & ~(sizeof(ulong64) - 1));
+	ulong64 heapMin = HeapMin;
+	ulong64 heapSpan = HeapMax - HeapMin;
+	ulong64 candidates[SCAN_BATCH];
+
+	for (; word + SCAN_BATCH <= end; word += SCAN_BATCH) {
+
+		ScanVec values = *(ScanVec*)word;
+		ScanVec inHeap = (values - heapMin) <= heapSpan;		// one unsigned compare per lane
+		int numCandidates = 0;
+
+		for (int i = 0; i < SCAN_BATCH; i++) {
+			if (inHeap[i]) {
+				candidates[numCandidates++] = values[i];
+				prefetchCandidate(values[i]);
+			}
+		}
+		for (int i = 0; i < numCandidates; i++)
+			markCandidate(marker, (char*)candidates[i]);
+	}
+
+	for (; word < end; word++)									// tail shorter than a batch
+		markCandidate(marker, (char*)*word);
+}
+
+
+/************************************************************************************************
+ * scan the fields of an object that lie in [from, to).											*
+ * An object typed by mycast() carries its pointer layout in Type: bit i says whether the i-th	*
+ * 8-byte field holds a pointer and the highest set bit terminates the pattern, which repeats	*
+ * over the whole object. Only the pointer fields of such objects are visited, so a type with	*
+ * no pointers (only the terminator set) is not scanned at all; untyped objects (Type == 0)	*
+ * are scanned conservatively.																	*
+ ************************************************************************************************/
+static void scanObjectRange(GCWorker *marker, ObjHeader *objHeader, unsigned char *from, unsigned char *to) {
+
+	unsigned char *start = (unsigned char*)objHeader + OBJ_HEADER_SIZE;
+	ulong64 type = objHeader -> Type;
+
+	if (type == 0 || ConservativeScan || UnalignedScan) {
+		scanRoots(marker, from, to);
+		return;
+	}
+
+	int numFields = 63 - __builtin_clzll(type);
+	ulong64 fields = type ^ (1ULL << numFields);					// unset the terminator
+	if (fields == 0)												// no pointer fields
+		return;
+
+	size_t period = numFields * sizeof(ulong64);
+	unsigned char *base = start + (from - start) / period * period;	// first pattern overlapping from
+	for (; base < to; base += period) {
+		for (ulong64 bits = fields; bits; bits &= bits - 1) {
+			ulong64 *slot = (ulong64*)base + __builtin_ctzll(bits);
+			if ((unsigned char*)(slot + 1) > to)					// the range ends mid-pattern
+				break;
+			if ((unsigned char*)slot >= from)
+				markCandidate(marker, (char*)*slot);
+		}
+	}
+}
+
+static void scanObject(GCWorker *marker, ObjHeader *objHeader) {
+	scanObjectRange(marker, objHeader, (unsigned char*)objHeader + OBJ_HEADER_SIZE,
+		(unsigned char*)objHeader + objHeader -> Size);
+}
+
+/************************************************************************************************
+ * scan the old (marked) objects overlapping a dirty card for pointers to young objects.		*
+ * Small-object cards lie within a page: the walk starts at the last object starting at or	*
+ * before the card and follows the sizes. A big object's header is found by walking back to	*
+ * its first page, and only the part of it on the card is scanned.								*
+ ************************************************************************************************/
+static void scanCard(GCWorker *marker, Segment *seg, char *cardStart) {
+
+	char *cardEnd = cardStart + CARD_SIZE;
+	char *allocPtr = getAllocPtr(seg);
+	cardEnd = (cardEnd < allocPtr) ? cardEnd : allocPtr;
+
+	if (getBigAlloc(seg)) {
+		char *page = ADDR_TO_PAGE(cardStart);
+		unsigned short szMeta;
+		while ((szMeta = getSizeMetadata(page)[0]) == 0) page -= PAGE_SIZE;
+		ObjHeader *objHeader = (ObjHeader*)page;
+		if (szMeta != 1 || !isMarked(objHeader))					// freed or young
+			return;
+		unsigned char *start = (unsigned char*)objHeader + OBJ_HEADER_SIZE;
+		scanObjectRange(marker, objHeader, (unsigned char*)cardStart > start ? (unsigned char*)cardStart : start,
+			(unsigned char*)cardEnd);
+		return;
+	}
+
+	char *page = ADDR_TO_PAGE(cardStart);
+	if (getSizeMetadata(page)[0] == PAGE_SIZE)						// page is free
+		return;
+	ObjHeader *first = findObjectStart(cardStart);
+	char *ptr = first ? (char*)first : page;
+
+	while (ptr < cardEnd) {
+		ObjHeader *objHeader = (ObjHeader*)ptr;
+		unsigned char *start = (unsigned char*)objHeader + OBJ_HEADER_SIZE;
+		unsigned char *end = (unsigned char*)objHeader + objHeader -> Size;
+		ptr += objHeader -> Size;
+		if (objHeader -> Status == FREE || !isMarked(objHeader) || (char*)end <= cardStart)
+			continue;
+		scanObjectRange(marker, objHeader, (unsigned char*)cardStart > start ? (unsigned char*)cardStart : start,
+			(char*)end < cardEnd ? end : (unsigned char*)cardEnd);
+	}
+}
+
+/* minor collections: the dirty cards are roots, and are clean again afterwards */
+static void scanDirtyCards(GCWorker *marker) {
+
+	for (int segIdx = 0; segIdx < NumSegments; segIdx++) {
+
+		Segment *seg = Segments[segIdx];
+		unsigned char *card = getCard(getDataPtr(seg));
+		unsigned char *last = getCard(getAllocPtr(seg));
+
+		for (; card <= last; card++) {
+			if (((ulong64)card & 7) == 0 && card + 8 <= last && *(ulong64*)card == 0) {
+				card += 7;											// eight clean cards at once
+				continue;
+			}
+			if (*card) {
+				*card = 0;
+				scanCard(marker, seg, (char*)seg + (card - seg -> CardTable) * CARD_SIZE);
+			}
+		}
+	}
+}
+
+/************************************************************************************************
+ * the mark stack overflowed, so some marked objects were never scanned. Scan every marked		*
+ * object in the heap again; this can only add more grey objects to the mark stack.			*
+ ************************************************************************************************/
+static void rescanMarkedObjects(GCWorker *marker) {
+
+	for (int segIdx = 0; segIdx < NumSegments; segIdx++) {
+
+		char *startptr = getDataPtr(Segments[segIdx]);
+		char *endptr = getAllocPtr(Segments[segIdx]);
+
+		while (startptr < endptr) {
+
+			if (getSizeMetadata(ADDR_TO_PAGE(startptr))[0] == PAGE_SIZE) {
+				startptr = ADDR_TO_PAGE(startptr) + PAGE_SIZE;		// page is free, go to next page
+				continue;
+			}
+			ObjHeader *objHeader = (ObjHeader*)startptr;
+			startptr += objHeader -> Size;
+			if (objHeader -> Status != FREE && isMarked(objHeader))
+				scanObject(marker, objHeader);
+		}
+	}
+}
+
+/************************************************************************************************
+ * scan objects on the mark stack, most recently marked first.									*
+ * newly encountered unmarked objects are marked and pushed on the mark stack.					*
+ * an overflow leaves objects marked but unscanned, so the heap is rescanned for them until		*
+ * the stack absorbs everything.																*
+ ************************************************************************************************/
+static void scanner(GCWorker *marker) {
+
+	ObjHeader *objHeader;
+	do {
+		while ((objHeader = popGrey(marker)))
+			scanObject(marker, objHeader);
+
+		if (!marker -> Stack.Overflow)
+			break;
+		marker -> Stack.Overflow = 0;
+		rescanMarkedObjects(marker);
+	} while (1);
+}
+
+/************************************************************************************************
+ * GC threads.																					*
+ * NumGCThreads-1 helper threads are started on the first parallel collection and sleep 		*
+ * between jobs. runGCJob() hands the same job to the GC thread (worker 0) and to the helpers	*
+ * and returns once all of them finished it; workers beyond the job's thread count skip it.		*
+ ************************************************************************************************/
+static pthread_mutex_t GCJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t GCJobStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t GCJobDone = PTHREAD_COND_INITIALIZER;
+static void (*GCJob)(GCWorker *Worker);
+static int NumJobWorkers = 0;
+static unsigned long GCJobEpoch = 0;
+static int NumWorkersDone = 0;
+
+static void* gcWorkerThread(void *Arg)
+{
+	GCWorker *Worker = (GCWorker*)Arg;
+	unsigned long SeenEpoch = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&GCJobLock);
+		while (GCJobEpoch == SeenEpoch)
+		{
+			pthread_cond_wait(&GCJobStart, &GCJobLock);
+		}
+		SeenEpoch = GCJobEpoch;
+		pthread_mutex_unlock(&GCJobLock);
+
+		if (Worker->Id < NumJobWorkers)
+		{
+			GCJob(Worker);
+		}
+
+		pthread_mutex_lock(&GCJobLock);
+		NumWorkersDone++;
+		pthread_cond_signal(&GCJobDone);
+		pthread_mutex_unlock(&GCJobLock);
+	}
+	return NULL;
+}
+
+static void startGCThreads()
+{
+	static int Started = 0;
+	int Iter;
+
+	if (Started)
+	{
+		return;
+	}
+	Started = 1;
+	for (Iter = 0; Iter < NumGCThreads; Iter++)
+	{
+		GCWorker *Worker = &GCWorkers[Iter];
+		Worker->Id = Iter;
+		Worker->Parallel = 1;
+		Worker->Sweep.Private = 1;
+		initWorkDeque(&Worker->Deque);
+		if (Iter > 0 && pthread_create(&Worker->Thread, NULL, gcWorkerThread, Worker) != 0)
+		{
+			printf("unable to create a GC thread\n");
+			exit(0);
+		}
+	}
+}
+
+static void runGCJob(void (*Job)(GCWorker *Worker), int NumWorkers)
+{
+	startGCThreads();
+
+	pthread_mutex_lock(&GCJobLock);
+	GCJob = Job;
+	NumJobWorkers = NumWorkers;
+	NumWorkersDone = 0;
+	GCJobEpoch++;
+	pthread_cond_broadcast(&GCJobStart);
+	pthread_mutex_unlock(&GCJobLock);
+
+	Job(&GCWorkers[0]);
+
+	pthread_mutex_lock(&GCJobLock);
+	while (NumWorkersDone < NumGCThreads - 1)
+	{
+		pthread_cond_wait(&GCJobDone, &GCJobLock);
+	}
+	pthread_mutex_unlock(&GCJobLock);
+}
+
+/************************************************************************************************
+ * Parallel marking.																			*
+ * The GC thread scans the roots serially, deals the grey objects out to the markers' deques	*
+ * and then marks together with NumMarkThreads-1 helper threads. A marker that runs out of		*
+ * local work steals from the other deques; marking ends once no marker is active.				*
+ ************************************************************************************************/
+static int NumActiveMarkers = 0;
+
+static ObjHeader* stealGrey(GCWorker *Marker)
+{
+	int Iter;
+	for (Iter = 1; Iter < NumMarkThreads; Iter++)
+	{
+		GCWorker *Victim = &GCWorkers[(Marker->Id + Iter) % NumMarkThreads];
+		if (isWorkDequeEmpty(&Victim->Deque))
+		{
+			continue;
+		}
+		/* become active before taking work, so termination is never seen early */
+		__atomic_add_fetch(&NumActiveMarkers, 1, __ATOMIC_SEQ_CST);
+		ObjHeader *Header = stealWorkDeque(&Victim->Deque);
+		if (Header)
+		{
+			return Header;
+		}
+		__atomic_sub_fetch(&NumActiveMarkers, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+static void markInParallel(GCWorker *Marker)
+{
+	ObjHeader *Header;
+
+	while (1)
+	{
+		while ((Header = popGrey(Marker)))
+		{
+			scanObject(Marker, Header);
+		}
+
+		__atomic_sub_fetch(&NumActiveMarkers, 1, __ATOMIC_SEQ_CST);
+		while ((Header = stealGrey(Marker)) == NULL)
+		{
+			if (__atomic_load_n(&NumActiveMarkers, __ATOMIC_SEQ_CST) == 0)
+			{
+				return;
+			}
+			sched_yield();
+		}
+		scanObject(Marker, Header);
+	}
+}
+
+/* grey objects found by the serial root scan become the markers' initial work */
+static void parallelScanner()
+{
+	ObjHeader *Header;
+	int Iter = 0;
+
+	startGCThreads();
+	while ((Header = popMarkStack(&SerialMarker.Stack)))
+	{
+		pushGrey(&GCWorkers[Iter], Header);
+		Iter = (Iter + 1) % NumMarkThreads;
+	}
+
+	NumActiveMarkers = NumMarkThreads;
+	runGCJob(markInParallel, NumMarkThreads);
+
+	/* dropped pushes are recovered by the serial scanner's rescan */
+	for (Iter = 0; Iter < NumMarkThreads; Iter++)
+	{
+		if (GCWorkers[Iter].Stack.Overflow)
+		{
+			GCWorkers[Iter].Stack.Overflow = 0;
+			SerialMarker.Stack.Overflow = 1;
+		}
+	}
+	if (SerialMarker.Stack.Overflow)
+	{
+		scanner(&SerialMarker);
+	}
+}
+
+/************************************************************************************************
+ * Sweeping.																					*
+ * sweep() splits the heap into units of SWEEP_UNIT_PAGES pages (a big-object segment is one 	*
+ * unit) and rebuilds the free lists from them. The units are swept on the GC threads, or, 	*
+ * with LazySweep, only the big-object segments and the partially bump-allocated page of each	*
+ * small-object segment are swept in the pause and the remaining units are left to _mymalloc,	*
+ * which sweeps them one at a time when the free lists can not satisfy a request. New objects	*
+ * never land in an unswept unit: they are bumped past it or carved from swept holes. Pending	*
+ * units are finished before the next collection starts marking.								*
+ ************************************************************************************************/
+static SweepUnit *SweepUnits = NULL;
+static size_t NumSweepUnits = 0;
+static size_t MaxSweepUnits = 0;
+static size_t NextSweepUnit = 0;
+static SweepContext SerialSweep;
+
+static void addSweepUnit(char *Start, char *End, int BigAlloc)
+{
+	if (NumSweepUnits == MaxSweepUnits)
+	{
+		size_t NewMax = MaxSweepUnits ? MaxSweepUnits * 2 : 1024;
+		SweepUnits = growArray(SweepUnits, MaxSweepUnits * sizeof(SweepUnit), NewMax * sizeof(SweepUnit));
+		MaxSweepUnits = NewMax;
+		if (SweepUnits == NULL)
+		{
+			printf("unable to allocate sweep units\n");
+			exit(0);
+		}
+	}
+	SweepUnits[NumSweepUnits].Start = Start;
+	SweepUnits[NumSweepUnits].End = End;
+	SweepUnits[NumSweepUnits].BigAlloc = BigAlloc;
+	NumSweepUnits++;
+}
+
+static void sweepInParallel(GCWorker *Worker)
+{
+	size_t Idx;
+	while ((Idx = __atomic_fetch_add(&NextSweepUnit, 1, __ATOMIC_RELAXED)) < NumSweepUnits)
+	{
+		sweepUnit(&SweepUnits[Idx], &Worker->Sweep);
+	}
+}
+
+static int sweepNextUnit()
+{
+	if (NextSweepUnit >= NumSweepUnits)
+	{
+		return 0;
+	}
+	sweepUnit(&SweepUnits[NextSweepUnit++], &SerialSweep);
+	spliceSweepContext(&SerialSweep);
+	return 1;
+}
+
+static void finishSweep()
+{
+	while (sweepNextUnit());
+	flushDecommits();
+}
+
+void sweep()
+{
+	int SegIdx, Iter;
+
+	resetFreeLists();
+	NumSweepUnits = NextSweepUnit = 0;
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		Segment *Seg = Segments[SegIdx];
+		char *Start = getDataPtr(Seg);
+		char *AllocPtr = getAllocPtr(Seg);
+		char *BumpPage = ADDR_TO_PAGE(AllocPtr);
+
+		if (getBigAlloc(Seg))
+		{
+			addSweepUnit(Start, AllocPtr, 1);
+			continue;
+		}
+		for (; Start < BumpPage; Start += SWEEP_UNIT_PAGES * PAGE_SIZE)
+		{
+			char *End = Start + SWEEP_UNIT_PAGES * PAGE_SIZE;
+			addSweepUnit(Start, (End < BumpPage) ? End : BumpPage, 0);
+		}
+		if (BumpPage < AllocPtr)
+		{
+			addSweepUnit(BumpPage, AllocPtr, 0);
+		}
+	}
+
+	if (LazySweep)
+	{
+		/* sweep what new objects could be allocated into, leave the rest pending */
+		size_t NumPending = 0;
+		for (Iter = 0; Iter < NumSweepUnits; Iter++)
+		{
+			SweepUnit *Unit = &SweepUnits[Iter];
+			if (Unit->BigAlloc || ADDR_TO_PAGE(Unit->Start) == ADDR_TO_PAGE(Unit->End - 1))
+			{
+				sweepUnit(Unit, &SerialSweep);
+			}
+			else
+			{
+				SweepUnits[NumPending++] = *Unit;
+			}
+		}
+		spliceSweepContext(&SerialSweep);
+		NumSweepUnits = NumPending;
+	}
+	else if (NumSweepThreads > 1)
+	{
+		runGCJob(sweepInParallel, NumSweepThreads);
+		for (Iter = 0; Iter < NumSweepThreads; Iter++)
+		{
+			spliceSweepContext(&GCWorkers[Iter].Sweep);
+		}
+	}
+	else
+	{
+		while (sweepNextUnit());
+	}
+	flushDecommits();
+	rebuildBigExtents();
+}
+
+
+static size_t
+getDataSecSz()
+{
+	char Exec[PATH_SZ];
+	static size_t DsecSz = 0;
+
+	if (DsecSz != 0)
+	{
+		return DsecSz;
+	}
+	DsecSz = -1;
+
+	ssize_t Count = readlink( "/proc/self/exe", Exec, PATH_SZ);
+
+	if (Count == -1) {
+		return -1;
+	}
+	Exec[Count] = '\0';
+
+	int fd = open(Exec, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat Statbuf;
+	fstat(fd, &Statbuf);
+
+	char *Base = mmap(NULL, Statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (Base == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	Elf64_Ehdr *Header = (Elf64_Ehdr*)Base;
+
+	if (Header->e_ident[0] != 0x7f
+		|| Header->e_ident[1] != 'E'
+		|| Header->e_ident[2] != 'L'
+		|| Header->e_ident[3] != 'F')
+	{
+		goto out;
+	}
+
+	int i;
+	Elf64_Shdr *Shdr = (Elf64_Shdr*)(Base + Header->e_shoff);
+	char *Strtab = Base + Shdr[Header->e_shstrndx].sh_offset;
+
+	for (i = 0; i < Header->e_shnum; i++)
+	{
+		char *Name = Strtab + Shdr[i].sh_name;
+		if (!strncmp(Name, ".data", 6))
+		{
+			DsecSz = Shdr[i].sh_size;
+		}
+	}
+
+out:
+	munmap(Base, Statbuf.st_size);
+	close(fd);
+	return DsecSz;
+}
+
+
+
+/* free bytes on the small-object pages that are in use, over the size of those pages */
+static double getFragmentation()
+{
+	long long FreeBytes = 0, UsedPages = 0;
+	int SegIdx;
+
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		Segment *Seg = Segments[SegIdx];
+		char *AllocPtr = getAllocPtr(Seg);
+		char *Page;
+
+		if (getBigAlloc(Seg))
+		{
+			continue;
+		}
+		for (Page = getDataPtr(Seg); Page < AllocPtr; Page += PAGE_SIZE)
+		{
+			unsigned short Free = getSizeMetadata(Page)[0];
+			if (Free != PAGE_SIZE)
+			{
+				FreeBytes += Free;
+				UsedPages++;
+			}
+		}
+	}
+	return UsedPages ? (double)FreeBytes / (UsedPages * PAGE_SIZE) : 0;
+}
+
+static void logCollection(const char *Kind, double Pause, double Roots, double Mark, double Sweep)
+{
+	static long long LastBytesFreed = 0, LastObjectsFreed = 0, LastPagesDecommitted = 0;
+	static long long LastAllocSizes[NUM_ALLOC_SIZE_BUCKETS];
+	long long PagesDecommitted = __atomic_load_n(&NumPagesDecommitted, __ATOMIC_RELAXED);
+	const char *Separator = "";
+	int Bucket;
+
+	fprintf(GCLog, "{\"gc\":%lld,\"kind\":\"%s\",\"pause_ms\":%.3f,\"roots_ms\":%.3f,\"mark_ms\":%.3f,"
+		"\"sweep_ms\":%.3f,\"marked_bytes\":%lld,\"freed_bytes\":%lld,\"freed_objects\":%lld,"
+		"\"decommitted_pages\":%lld,\"segments\":%d,\"heap_bytes\":%lld,\"next_gc_bytes\":%lld,"
+		"\"fragmentation\":%.4f,\"alloc_sizes\":{",
+		NumGCTriggered, Kind, Pause, Roots, Mark, Sweep, LastMarkedBytes,
+		NumBytesFreed - LastBytesFreed, NumObjectsFreed - LastObjectsFreed,
+		PagesDecommitted - LastPagesDecommitted, NumSegments, NumBytesAllocated - NumBytesFreed,
+		GCTrigger, getFragmentation());
+	/* allocations since the last record, keyed by the smallest size of the bucket */
+	for (Bucket = 0; Bucket < NUM_ALLOC_SIZE_BUCKETS; Bucket++)
+	{
+		if (AllocSizeHistogram[Bucket] != LastAllocSizes[Bucket])
+		{
+			fprintf(GCLog, "%s\"%llu\":%lld", Separator, 1ULL << Bucket, AllocSizeHistogram[Bucket] - LastAllocSizes[Bucket]);
+			LastAllocSizes[Bucket] = AllocSizeHistogram[Bucket];
+			Separator = ",";
+		}
+	}
+	fprintf(GCLog, "}}\n");
+	fflush(GCLog);
+
+	LastBytesFreed = NumBytesFreed;
+	LastObjectsFreed = NumObjectsFreed;
+	LastPagesDecommitted = PagesDecommitted;
+}
+
+/* the timestamps split a pause into root scanning, marking and sweeping */
+static void recordPause(const char *Kind, double PauseStart, double RootsEnd, double SweepStart, double PauseEnd)
+{
+	double Pause = PauseEnd - PauseStart;
+	int Bucket = 0;
+
+	GCRootScanTotal += RootsEnd - PauseStart;
+	GCMarkTotal += SweepStart - RootsEnd;
+	GCSweepTotal += PauseEnd - SweepStart;
+	GCPauseTotal += Pause;
+	GCPauseMax = (Pause > GCPauseMax) ? Pause : GCPauseMax;
+	NumPauses++;
+	while (Bucket < NUM_PAUSE_BUCKETS - 1 && Pause >= (1 << Bucket))
+	{
+		Bucket++;
+	}
+	PauseHistogram[Bucket]++;
+
+	if (GCLog)
+	{
+		logCollection(Kind, Pause, RootsEnd - PauseStart, SweepStart - RootsEnd, PauseEnd - SweepStart);
+	}
+}
+
+/* globals and the stacks of all registered threads, which must be stopped */
+static void scanAllRoots(GCWorker *Marker, void (*Scan)(GCWorker*, unsigned char*, unsigned char*))
+{
+	GCThread *Thread;
+
+	size_t DataSecSz = getDataSecSz();
+	unsigned char *DataStart;
+
+	if (DataSecSz == -1)
+	{
+		DataStart = (unsigned char*)&etext;
+	}
+	else
+	{
+		DataStart = (unsigned char*)((char*)&edata - DataSecSz);
+	}
+	unsigned char *DataEnd = (unsigned char*)(&edata);
+
+	/* scan global variables */
+	Scan(Marker, DataStart, DataEnd);
+
+	unsigned char *UnDataStart = (unsigned char*)(&edata);
+	unsigned char *UnDataEnd = (unsigned char*)(&end);
+
+	/* scan uninitialized global variables */
+	Scan(Marker, UnDataStart, UnDataEnd);
+
+	/* a mutator collecting itself entered through mymalloc or runGC in mem.s */
+	if (Self)
+	{
+		int Lvar;
+		unsigned char *Bottom = (unsigned char*)Self->StackBottom;
+		unsigned char *Top = (unsigned char*)&Lvar;
+		/* skip GC stack frame */
+		while (*((unsigned*)Top) != MAGIC_ADDR)
+		{
+			assert(Top < Bottom);
+			Top++;
+		}
+		/* scan application stack */
+		if (!PreciseStack || !scanStackPrecisely(Marker, Scan, Top, Bottom))
+		{
+			Scan(Marker, Top, Bottom);
+			NumConservativeStackScans += PreciseStack;
+		}
+		else
+		{
+			NumPreciseStackScans++;
+		}
+	}
+
+	/* scan the stacks of the stopped threads */
+	for (Thread = Threads; Thread; Thread = Thread->Next)
+	{
+		if (Thread != Self)
+		{
+			Scan(Marker, (unsigned char*)Thread->StackTop, (unsigned char*)Thread->StackBottom);
+		}
+	}
+}
+
+/************************************************************************************************
+ * Evacuation.																					*
+ * A small-object page is only reclaimed once all of its objects are dead, so a few survivors	*
+ * can hold on to many mostly empty pages. After marking, the survivors of pages that are less	*
+ * than EvacuatePercent live are copied to fresh pages, and the precise slots of all marked		*
+ * objects are redirected to the copies; the sweep then releases the emptied pages. Words that	*
+ * are scanned conservatively (roots and objects without a layout) may not be pointers, so a	*
+ * page they refer to is pinned and left in place.												*
+ ************************************************************************************************/
+static EvacPage *EvacPages = NULL;
+static size_t NumEvacPages = 0;
+static size_t MaxEvacPages = 0;
+/* the fresh memory the survivors are copied to */
+static char *EvacPtr = NULL;
+static char *EvacEnd = NULL;
+
+static int compareEvacPages(const void *A, const void *B)
+{
+	char *PageA = ((const EvacPage*)A)->Page;
+	char *PageB = ((const EvacPage*)B)->Page;
+	return (PageA > PageB) - (PageA < PageB);
+}
+
+static EvacPage* findEvacPage(char *Page)
+{
+	EvacPage Key = { Page, 0 };
+	return bsearch(&Key, EvacPages, NumEvacPages, sizeof(EvacPage), compareEvacPages);
+}
+
+static void addEvacPage(char *Page)
+{
+	if (NumEvacPages == MaxEvacPages)
+	{
+		size_t NewMax = MaxEvacPages ? MaxEvacPages * 2 : 1024;
+		EvacPages = growArray(EvacPages, MaxEvacPages * sizeof(EvacPage), NewMax * sizeof(EvacPage));
+		MaxEvacPages = NewMax;
+		if (EvacPages == NULL)
+		{
+			printf("unable to allocate the evacuation set\n");
+			exit(0);
+		}
+	}
+	EvacPages[NumEvacPages].Page = Page;
+	EvacPages[NumEvacPages].Pinned = 0;
+	NumEvacPages++;
+}
+
+static void findSparsePages()
+{
+	int SegIdx;
+
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		Segment *Seg = Segments[SegIdx];
+		char *AllocPtr = getAllocPtr(Seg);
+		char *Page;
+
+		if (getBigAlloc(Seg))
+		{
+			continue;
+		}
+		for (Page = getDataPtr(Seg); Page < AllocPtr; Page += PAGE_SIZE)
+		{
+			char *End = (Page + PAGE_SIZE < AllocPtr) ? Page + PAGE_SIZE : AllocPtr;
+			char *Ptr = Page;
+			size_t Live = 0;
+			int Aligned = 0;
+
+			if (getSizeMetadata(Page)[0] == PAGE_SIZE)
+			{
+				continue;
+			}
+			while (Ptr < End)
+			{
+				ObjHeader *Header = (ObjHeader*)Ptr;
+				Ptr += Header->Size;
+				if (Header->Status != FREE && isMarked(Header))
+				{
+					Live += Header->Size;
+					/* GetAlignedAddr() handed out an address that a copy would not keep aligned */
+					Aligned |= Header->Alignment != 0;
+				}
+			}
+			if (Live > 0 && !Aligned && Live * 100 < (size_t)PAGE_SIZE * EvacuatePercent)
+			{
+				addEvacPage(Page);
+			}
+		}
+	}
+}
+
+/* pin the sparse pages that a conservatively scanned range refers to */
+static void pinRange(GCWorker *Unused, unsigned char *Top, unsigned char *Bottom)
+{
+	ulong64 *Word = (ulong64*)Align((ulong64)Top, sizeof(ulong64));
+	ulong64 *End = (ulong64*)((ulong64)Bottom & ~(sizeof(ulong64) - 1));
+
+	for (; Word < End; Word++)
+	{
+		ObjHeader *Header = getObjectHeader((char*)*Word);
+		EvacPage *Page;
+		if (Header && (Page = findEvacPage(ADDR_TO_PAGE(Header))))
+		{
+			Page->Pinned = 1;
+		}
+	}
+}
+
+static void walkMarkedObjects(void (*Visit)(ObjHeader *Header))
+{
+	int SegIdx;
+
+	for (SegIdx = 0; SegIdx < NumSegments; SegIdx++)
+	{
+		char *Ptr = getDataPtr(Segments[SegIdx]);
+		char *End = getAllocPtr(Segments[SegIdx]);
+
+		while (Ptr < End)
+		{
+			if (getSizeMetadata(ADDR_TO_PAGE(Ptr))[0] == PAGE_SIZE)
+			{
+				Ptr = ADDR_TO_PAGE(Ptr) + PAGE_SIZE;
+				continue;
+			}
+			ObjHeader *Header = (ObjHeader*)Ptr;
+			Ptr += Header->Size;
+			if (Header->Status != FREE && isMarked(Header))
+			{
+				Visit(Header);
+			}
+		}
+	}
+}
+
+static void pinConservativeObject(ObjHeader *Header)
+{
+	if (Header->Type == 0)
+	{
+		pinRange(NULL, (unsigned char*)Header + OBJ_HEADER_SIZE, (unsigned char*)Header + Header->Size);
+	}
+}
+
+/* the survivors are copied into fresh pages only, never back into sparse ones */
+static ObjHeader* evacAlloc(size_t Size)
+{
+	if ((size_t)(EvacEnd - EvacPtr) < Size)
+	{
+		createHole(EvacPtr, EvacEnd);
+		EvacPtr = takeFreshPage();
+		EvacEnd = EvacPtr + PAGE_SIZE;
+	}
+	ObjHeader *Header = (ObjHeader*)EvacPtr;
+	EvacPtr += Size;
+	return Header;
+}
 
-	if (UnscannedListHead == NULL)
-		UnscannedListHead = node;
-	else
-		UnscannedListTail -> next = node;
-	UnscannedListTail = node;
+static void evacuatePage(char *Page)
+{
+	char *AllocPtr = getAllocPtr(ADDR_TO_SEGMENT(Page));
+	char *End = (Page + PAGE_SIZE < AllocPtr) ? Page + PAGE_SIZE : AllocPtr;
+	char *Ptr = Page;
+
+	while (Ptr < End)
+	{
+		ObjHeader *Header = (ObjHeader*)Ptr;
+		Ptr += Header->Size;
+		if (Header->Status == FREE || !isMarked(Header))
+		{
+			continue;
+		}
+		ObjHeader *Copy = evacAlloc(Header->Size);
+		memcpy(Copy, Header, Header->Size);
+		setObjectStart(Copy);
+		setMarkAtomic(Copy);
+		/* the original is left unmarked, so the sweep frees it */
+		clearMark(Header);
+		Header->Status = FORWARDED;
+		Header->Type = (ulong64)Copy;
+		NumBytesAllocated += Copy->Size;
+		NumBytesEvacuated += Copy->Size;
+	}
+	NumPagesEvacuated++;
 }
 
+/* redirect the precise slots of a survivor that refer to moved objects */
+/*
+ * calls Visit on every slot of the object that may hold a pointer: the
+ * slots its Type names, or every word when it has no layout
+ */
+static void visitPointerSlots(ObjHeader *Header, void (*Visit)(ulong64 *Slot))
+{
+	ulong64 Type = Header->Type;
+	ulong64 *Start = (ulong64*)((char*)Header + OBJ_HEADER_SIZE);
+	ulong64 *End = (ulong64*)((char*)Header + Header->Size);
 
-/************************************************************************************************
- * Idea:																						*
- *		We can iterate over segments stored in SegmentList. 									*
- * 		In each segment, iterate from dataptr to allocptr. Since myfree stores the amount of	*
- *		memory free for each page, we can use it to know whether current page is free or not.	*
- * 		If free, then move to next page. Otherwise, start of the page will contain the 			*
- * 		objectHeader and using that we will free the object depending on its Status bit and 	*
- * 		move to next Header using the size of object stored in current objectHeader.			*
- ************************************************************************************************/
-void sweep() {
-	
-	SegmentList *segHead = Segments;
-	while (segHead) {
-		
-		char *startptr = getDataPtr(segHead -> Segment);
-		char *endptr = getAllocPtr(segHead -> Segment);
+	if (Type == 0)
+	{
+		for (; Start < End; Start++)
+		{
+			Visit(Start);
+		}
+		return;
+	}
+	int NumFields = 63 - __builtin_clzll(Type);
+	ulong64 Fields = Type ^ (1ULL << NumFields);
+	ulong64 *Base;
 
-		while(startptr < endptr) {
-			
-			if (getSizeMetadata(ADDR_TO_PAGE(startptr))[0] < PAGE_SIZE) {
-				
-				ObjHeader *objHeader = (ObjHeader*)(startptr);
-				startptr += objHeader -> Size;						// cannot be done later since page might be freed
-				
-				if(objHeader -> Status == 0){				
-					myfree((void*)objHeader + OBJ_HEADER_SIZE);		// object is not reachable, so free it
-				}
-				else if(objHeader -> Status == MARK) 		
-					objHeader -> Status = 0;						// object is reachable so cannot be freed, unmark it
+	for (Base = Start; Fields && Base < End; Base += NumFields)
+	{
+		ulong64 Bits;
+		for (Bits = Fields; Bits; Bits &= Bits - 1)
+		{
+			ulong64 *Slot = Base + __builtin_ctzll(Bits);
+			if (Slot >= End)
+			{
+				break;
 			}
-			else										
-				startptr = ADDR_TO_PAGE(startptr) + PAGE_SIZE;		// page is already free, go to next page
+			Visit(Slot);
 		}
-		segHead = segHead -> Next;									// go to next Segment
 	}
 }
 
-
-/************************************************************************************************
- * returns whether address lies in between Data Ptr and Alloc Ptr of some segment 				*
- ************************************************************************************************/
-int isPresentInSegmentList(char *addr) {
-	
-	SegmentList *head = Segments;
-	
-	while (head) {
-		
-		if (getDataPtr(head -> Segment) <= addr && addr <= getAllocPtr(head -> Segment))
-			return 1;
-		
-		head = head -> Next;
+static void fixupSlot(ulong64 *Slot)
+{
+	ObjHeader *Target = getObjectHeader((char*)*Slot);
+	if (Target && Target->Status == FORWARDED)
+	{
+		*Slot = *Slot - (ulong64)Target + Target->Type;
 	}
-	return 0;
 }
 
-/************************************************************************************************
- * returns: objectHeader corresponding to the object's reference stored in pointer: char *addr 	*
- *			returns NULL for invalid addresses 													*
- * Idea: 				 				 				 										*
- * 		Object's size >  PAGE_SIZE:  				 											*
- * 			"The metadata corresponding to the first page of a big allocation is set to one to 	*
- * 			identify the first byte of these objects." We exploit this feature to find the 		*
- * 			first page of big allocation which in turn stores the objectHeader corresponding 	*
- * 			to the given object at the top of that page. We do this by finding the page 		*
- * 			containing address stored in 'addr' and if the byte is not to set to one then we 	*
- * 			move on to previous page and repeat the same until we reach the first page and then *
- *  		return the objectHeader stored at top of this page. 								*
- *		Object's size <= PAGE_SIZE:																*
- * 			Since an object+its header lies on single page, we can find the page of given 		*
- * 			object. Also, we know that start of the page contains object header, may be of some *
- * 			other object, we can iterate on all object headers in current page using the size 	*
- * 			of object stored in object header which will help in finding next object Header in 	*
- * 			current	page and ultimately finding the header corresponding to given object. 		*
- ************************************************************************************************/
-ObjHeader* getObjectHeader(char *addr) {
-
-	if(isPresentInSegmentList(addr) == 0)
-		return NULL;
+static void fixupObject(ObjHeader *Header)
+{
+	/* conservatively scanned objects point only to pinned pages */
+	if (Header->Type != 0)
+	{
+		visitPointerSlots(Header, fixupSlot);
+	}
+}
 
-	if (getBigAlloc(ADDR_TO_SEGMENT(addr))) {	/* Find objectHeader for bigAlloc */
+/* called with the world stopped, after marking and before the sweep */
+static void evacuate()
+{
+	size_t Iter;
 
-		char *myPage = ADDR_TO_PAGE(addr);
-		// iterate until first page of bigAlloc is reached
-		while (getSizeMetadata(myPage)[0] != 1) myPage -= PAGE_SIZE;
-		// return objectHeader if application contained reference 
-		// to object and not to its header(i.e >= mypage + 16)
-		if (myPage + 16 <= addr)
-			return (ObjHeader*)myPage;
+	NumEvacPages = 0;
+	findSparsePages();
+	if (NumEvacPages == 0)
+	{
+		return;
 	}
-	else {										/* Find object header for smallAlloc*/
+	sortArray(EvacPages, NumEvacPages, sizeof(EvacPage), compareEvacPages);
+	scanAllRoots(NULL, pinRange);
+	walkMarkedObjects(pinConservativeObject);
 
-		ObjHeader *objHeader = (ObjHeader*)ADDR_TO_PAGE(addr);				// first header of current page
-		
-		while (1) {
-			
-			if (addr < (char*)objHeader + OBJ_HEADER_SIZE)					// application contains reference to header and not object
-				return NULL;
-			
-			if (addr <= (char*)objHeader + objHeader -> Size)
-				return objHeader;
-			
-			objHeader = (ObjHeader*)((char*)objHeader + objHeader -> Size);	// jump to next Header in current page
+	for (Iter = 0; Iter < NumEvacPages; Iter++)
+	{
+		if (!EvacPages[Iter].Pinned)
+		{
+			evacuatePage(EvacPages[Iter].Page);
 		}
 	}
-	return NULL;
+	createHole(EvacPtr, EvacEnd);
+	EvacPtr = EvacEnd = NULL;
+	walkMarkedObjects(fixupObject);
 }
 
+/*
+ * called with HeapLock held by a registered thread. In the generational
+ * mode marks are sticky: a minor collection keeps the marks of the
+ * objects that survived earlier collections, so it only traces objects
+ * allocated since the last one, starting from the roots and the dirty
+ * cards. Every MinorPerMajor-th collection, and every explicit one, is
+ * a full collection.
+ */
+static void collect(int Full)
+{
+	GCThread *Thread;
+	int Minor = Generational && !Full && MinorsSinceMajor < MinorPerMajor;
 
-/************************************************************************************************ 
- * walk all addresses in the range [Top, Bottom-8].												*
- * add unmarked valid objects to the scanner list after marking them for scanning.				*
- ************************************************************************************************/
-static void scanRoots(unsigned char *Top, unsigned char *Bottom) {	// top < bottom	
-	
-	Bottom -= 8;
-	for (unsigned char *addr = Top ; addr <= Bottom ;  addr++) {
-		
-		char *valueAtAddr = (char*)(*((ulong64*)addr));
-		ObjHeader *objHeader = getObjectHeader(valueAtAddr);
-		
-		if (objHeader && objHeader -> Status == 0) { 					// if object is not marked/free
-			objHeader -> Status = MARK;
-			addToUnscannedList((unsigned char*)objHeader);
+	NumGCTriggered++;
+	NumMinorGCs += Minor;
+	MinorsSinceMajor = Minor ? MinorsSinceMajor + 1 : 0;
+	double PauseStart = getTimeMs();
+
+	stopWorld();
+	for (Thread = Threads; Thread; Thread = Thread->Next)
+	{
+		retireTlab(Thread);
+	}
+
+	/* units left from the last cycle are swept with its marks */
+	finishSweep();
+	if (!Minor)
+	{
+		clearMarkBitmaps();
+		if (Generational)
+		{
+			clearCards();
 		}
 	}
-}
 
+	scanAllRoots(&SerialMarker, scanRoots);
 
-/************************************************************************************************
- * scan objects in the scanner list.															*
- * add newly encountered unmarked objects 														*
- * to the not scanned list after marking them.														*
- ************************************************************************************************/
-static void scanner() {
-	UnscannedList *nextHead = NULL;
-	while (UnscannedListHead) {
-		
-		scanRoots(UnscannedListHead -> objHeader + OBJ_HEADER_SIZE, 
-				  UnscannedListHead -> objHeader + ((ObjHeader*)UnscannedListHead -> objHeader) -> Size);
-		
-		nextHead = UnscannedListHead -> next;
-		free(UnscannedListHead);
-		UnscannedListHead = nextHead;
+	if (Minor)
+	{
+		scanDirtyCards(&SerialMarker);
+	}
+	double RootsEnd = getTimeMs();
+
+	if (NumMarkThreads > 1)
+	{
+		parallelScanner();
+	}
+	else
+	{
+		scanner(&SerialMarker);
+	}
+	updateGCTrigger(Minor);
+	if (EvacuatePercent && !Minor)
+	{
+		evacuate();
 	}
+	double SweepStart = getTimeMs();
+	sweep();
+	startWorld();
+	BytesSinceGC = 0;
+
+	recordPause(Minor ? "minor" : "full", PauseStart, RootsEnd, SweepStart, getTimeMs());
 }
 
+/************************************************************************************************
+ * Concurrent marking.																			*
+ * A collection starts with a short initial-mark pause that scans the roots into ConcMarker.	*
+ * The marker thread then traces while the mutators run: the MemSafe pass logs the value every	*
+ * store overwrites (GCPreWrite) and objects allocated meanwhile are born marked, so everything	*
+ * reachable at the start survives. The final remark pause marks the logged values, rescans	*
+ * the roots, which are not barriered, and sweeps.												*
+ ************************************************************************************************/
+#define CONC_IDLE 0
+#define CONC_MARKING 1
 
-static size_t
-getDataSecSz()
-{
-	char Exec[PATH_SZ];
-	static size_t DsecSz = 0;
+static int ConcPhase = CONC_IDLE;
+/* waited on with HeapLock, broadcast when a phase starts or ends */
+static pthread_cond_t ConcCond = PTHREAD_COND_INITIALIZER;
 
-	if (DsecSz != 0)
+static void markSATBEntries(GCWorker *Marker, ulong64 *Values, size_t Num)
+{
+	size_t Iter;
+	for (Iter = 0; Iter < Num; Iter++)
 	{
-		return DsecSz;
+		markCandidate(Marker, (char*)Values[Iter]);
 	}
-	DsecSz = -1;
+}
 
-	ssize_t Count = readlink( "/proc/self/exe", Exec, PATH_SZ);
+/* mark what the mutators handed over so far; returns whether there was anything */
+static int drainSATBQueue(GCWorker *Marker)
+{
+	ulong64 *Values;
+	size_t Num, Max;
+
+	pthread_mutex_lock(&SATBLock);
+	Values = SATBQueue;
+	Num = NumSATBEntries;
+	Max = MaxSATBEntries;
+	SATBQueue = NULL;
+	NumSATBEntries = MaxSATBEntries = 0;
+	pthread_mutex_unlock(&SATBLock);
+
+	markSATBEntries(Marker, Values, Num);
+	freeArray(Values, Max * sizeof(ulong64));
+	return Num != 0;
+}
 
-	if (Count == -1) {
-		return -1;
-	}
-	Exec[Count] = '\0';
+/*
+ * An overflowing mark stack is left for the remark pause:
+ * rescanMarkedObjects() walks the heap, which is only safe while the
+ * mutators are stopped.
+ */
+static void markConcurrently()
+{
+	ObjHeader *Header;
+	do
+	{
+		while ((Header = popGrey(&ConcMarker)))
+		{
+			scanObject(&ConcMarker, Header);
+		}
+	} while (drainSATBQueue(&ConcMarker));
+}
 
-	int fd = open(Exec, O_RDONLY);
-	if (fd == -1) {
-		return -1;
+/* called with HeapLock held by the marker thread */
+static void remark()
+{
+	GCThread *Thread;
+	double PauseStart = getTimeMs();
+
+	/* no thread may be stopped while it holds SATBLock */
+	pthread_mutex_lock(&SATBLock);
+	stopWorld();
+	for (Thread = Threads; Thread; Thread = Thread->Next)
+	{
+		retireTlab(Thread);
+		markSATBEntries(&ConcMarker, Thread->SATBBuffer, Thread->SATBCount);
+		Thread->SATBCount = 0;
 	}
+	markSATBEntries(&ConcMarker, SATBQueue, NumSATBEntries);
+	NumSATBEntries = 0;
 
-	struct stat Statbuf;
-	fstat(fd, &Statbuf);
+	scanAllRoots(&ConcMarker, scanRoots);
+	double RootsEnd = getTimeMs();
+	scanner(&ConcMarker);
+	MarkingActive = 0;
+	pthread_mutex_unlock(&SATBLock);
 
-	char *Base = mmap(NULL, Statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (Base == NULL) {
-		close(fd);
-		return -1;
+	double SweepStart = getTimeMs();
+	while (NumDeferredFrees > 0)
+	{
+		freeObject(DeferredFrees[--NumDeferredFrees]);
 	}
+	updateGCTrigger(0);
+	sweep();
+	startWorld();
+	BytesSinceGC = 0;
+	ConcPhase = CONC_IDLE;
+	pthread_cond_broadcast(&ConcCond);
 
-	Elf64_Ehdr *Header = (Elf64_Ehdr*)Base;
+	recordPause("remark", PauseStart, RootsEnd, SweepStart, getTimeMs());
+}
 
-	if (Header->e_ident[0] != 0x7f
-		|| Header->e_ident[1] != 'E'
-		|| Header->e_ident[2] != 'L'
-		|| Header->e_ident[3] != 'F')
+static void* concMarkerThread(void *Arg)
+{
+	pthread_mutex_lock(&HeapLock);
+	while (1)
 	{
-		goto out;
+		while (ConcPhase != CONC_MARKING)
+		{
+			pthread_cond_wait(&ConcCond, &HeapLock);
+		}
+		pthread_mutex_unlock(&HeapLock);
+
+		double MarkStart = getTimeMs();
+		markConcurrently();
+		double MarkTime = getTimeMs() - MarkStart;
+
+		pthread_mutex_lock(&HeapLock);
+		GCConcMarkTotal += MarkTime;
+		remark();
 	}
+	return NULL;
+}
 
-	int i;
-	Elf64_Shdr *Shdr = (Elf64_Shdr*)(Base + Header->e_shoff);
-	char *Strtab = Base + Shdr[Header->e_shstrndx].sh_offset;
+/* called with HeapLock held by a registered thread */
+static void initialMark()
+{
+	static int Started = 0;
+	GCThread *Thread;
+	pthread_t Marker;
 
-	for (i = 0; i < Header->e_shnum; i++)
+	if (!Started)
 	{
-		char *Name = Strtab + Shdr[i].sh_name;
-		if (!strncmp(Name, ".data", 6))
+		Started = 1;
+		ConcMarker.Parallel = 1;
+		initWorkDeque(&ConcMarker.Deque);
+		if (pthread_create(&Marker, NULL, concMarkerThread, NULL) != 0)
 		{
-			DsecSz = Shdr[i].sh_size;
+			printf("unable to create the marker thread\n");
+			exit(0);
 		}
 	}
 
-out:
-	munmap(Base, Statbuf.st_size);
-	close(fd);
-	return DsecSz;
+	NumGCTriggered++;
+	double PauseStart = getTimeMs();
+
+	pthread_mutex_lock(&SATBLock);
+	stopWorld();
+	for (Thread = Threads; Thread; Thread = Thread->Next)
+	{
+		retireTlab(Thread);
+		Thread->SATBCount = 0;
+	}
+	NumSATBEntries = 0;
+
+	finishSweep();
+	clearMarkBitmaps();
+	scanAllRoots(&ConcMarker, scanRoots);
+	MarkingActive = 1;
+	pthread_mutex_unlock(&SATBLock);
+	startWorld();
+	ConcPhase = CONC_MARKING;
+	pthread_cond_broadcast(&ConcCond);
+
+	double PauseEnd = getTimeMs();
+	LastMarkedBytes = 0;
+	recordPause("initial-mark", PauseStart, PauseEnd, PauseEnd, PauseEnd);
 }
 
+void _runGC()
+{
+	GCRegisterThread();
+	pthread_mutex_lock(&HeapLock);
+	while (ConcPhase != CONC_IDLE)
+	{
+		pthread_cond_wait(&ConcCond, &HeapLock);
+	}
+	collect(1);
+	pthread_mutex_unlock(&HeapLock);
+}
 
+/************************************************************************************************
+ * Heap snapshots.																				*
+ * dumpHeap in mem.s enters _dumpHeap the way runGC enters _runGC. After a full collection the	*
+ * marked objects are exactly the live ones; with the world stopped again, the objects the		*
+ * roots refer to and every live object with its outgoing edges are written to the file in the	*
+ * HeapDump* format of memory.h, for heapanalyze to read.										*
+ ************************************************************************************************/
+static FILE *DumpFile = NULL;
+static ulong64 NumDumpRecords;
+/* stdio would malloc the file's buffer on the first write, which happens in the pause */
+static char DumpBuffer[1 << 16];
 
-void _runGC()
+/* the live object that Addr points into, if any */
+static ObjHeader *getLiveTarget(ulong64 Addr)
 {
-	NumGCTriggered++;
+	ObjHeader *Header = getObjectHeader((char*)Addr);
+	if (Header && Header->Status != FREE && isMarked(Header))
+	{
+		return Header;
+	}
+	return NULL;
+}
 
-	size_t DataSecSz = getDataSecSz();
-	unsigned char *DataStart;
+static void dumpRootRange(GCWorker *Unused, unsigned char *Top, unsigned char *Bottom)
+{
+	ulong64 *Word = (ulong64*)Align((ulong64)Top, sizeof(ulong64));
+	ulong64 *End = (ulong64*)((ulong64)Bottom & ~(sizeof(ulong64) - 1));
 
-	if (DataSecSz == -1)
+	for (; Word < End; Word++)
 	{
-		DataStart = (unsigned char*)&etext;
+		ObjHeader *Header = getLiveTarget(*Word);
+		if (Header)
+		{
+			ulong64 Addr = (ulong64)Header;
+			fwrite(&Addr, sizeof(Addr), 1, DumpFile);
+			NumDumpRecords++;
+		}
 	}
-	else
+}
+
+static unsigned NumDumpEdges;
+
+static void countEdge(ulong64 *Slot)
+{
+	if (getLiveTarget(*Slot))
 	{
-		DataStart = (unsigned char*)((char*)&edata - DataSecSz);
+		NumDumpEdges++;
 	}
-	unsigned char *DataEnd = (unsigned char*)(&edata);
+}
 
-	/* scan global variables */
-	scanRoots(DataStart, DataEnd);
+static void dumpEdge(ulong64 *Slot)
+{
+	ObjHeader *Header = getLiveTarget(*Slot);
+	if (Header)
+	{
+		ulong64 Addr = (ulong64)Header;
+		fwrite(&Addr, sizeof(Addr), 1, DumpFile);
+	}
+}
 
-	unsigned char *UnDataStart = (unsigned char*)(&edata);
-	unsigned char *UnDataEnd = (unsigned char*)(&end);
+static void dumpObject(ObjHeader *Header)
+{
+	HeapDumpObject Record;
+
+	NumDumpEdges = 0;
+	visitPointerSlots(Header, countEdge);
+
+	Record.Addr = (ulong64)Header;
+	Record.Type = Header->Type;
+	Record.Size = Header->Size;
+	Record.NumEdges = NumDumpEdges;
+	fwrite(&Record, sizeof(Record), 1, DumpFile);
+	visitPointerSlots(Header, dumpEdge);
+	NumDumpRecords++;
+}
 
-	/* scan uninitialized global variables */
-	scanRoots(UnDataStart, UnDataEnd);
+int _dumpHeap(const char *Path)
+{
+	HeapDumpHeader Header = { HEAP_DUMP_MAGIC, 0, 0 };
+	GCThread *Thread;
 
-	
-	int Lvar;
-	void *Base;
-	size_t Size;
-	pthread_attr_t Attr;
-	
-	int Ret = pthread_getattr_np(pthread_self(), &Attr);
-	if (Ret != 0)
+	GCRegisterThread();
+	pthread_mutex_lock(&HeapLock);
+	while (ConcPhase != CONC_IDLE)
 	{
-		printf("Error getting stackinfo\n");
-		return;
+		pthread_cond_wait(&ConcCond, &HeapLock);
 	}
-	Ret = pthread_attr_getstack(&Attr , &Base, &Size);
-	if (Ret != 0)
+	DumpFile = fopen(Path, "wb");
+	if (DumpFile == NULL)
 	{
-		printf("Error getting stackinfo\n");
-		return;
+		pthread_mutex_unlock(&HeapLock);
+		return -1;
 	}
-	unsigned char *Bottom = (unsigned char*)(Base + Size);
-	unsigned char *Top = (unsigned char*)&Lvar;
-	/* skip GC stack frame */
-	while (*((unsigned*)Top) != MAGIC_ADDR)
+	setvbuf(DumpFile, DumpBuffer, _IOFBF, sizeof(DumpBuffer));
+	collect(1);
+
+	/* nothing is allocated while HeapLock is held, but stores go on until the world stops */
+	stopWorld();
+	for (Thread = Threads; Thread; Thread = Thread->Next)
 	{
-		assert(Top < Bottom);
-		Top++;
+		retireTlab(Thread);
 	}
-	/* scan application stack */
-	scanRoots(Top, Bottom);
-
-	scanner();
-	sweep();
+	fwrite(&Header, sizeof(Header), 1, DumpFile);
+
+	NumDumpRecords = 0;
+	scanAllRoots(NULL, dumpRootRange);
+	Header.NumRoots = NumDumpRecords;
+
+	NumDumpRecords = 0;
+	walkMarkedObjects(dumpObject);
+	Header.NumObjects = NumDumpRecords;
+	startWorld();
+
+	fseek(DumpFile, 0, SEEK_SET);
+	fwrite(&Header, sizeof(Header), 1, DumpFile);
+	int Failed = ferror(DumpFile);
+	Failed |= fclose(DumpFile);
+	DumpFile = NULL;
+	pthread_mutex_unlock(&HeapLock);
+	return Failed ? -1 : 0;
 }
 
+/* called with HeapLock held */
 static void checkAndRunGC(size_t Sz)
 {
-	static size_t TotalAlloc = 0;
-
-	TotalAlloc += Sz;
-	if (TotalAlloc < GC_THRESHOLD)
+	BytesSinceGC += Sz;
+	if (BytesSinceGC < GCTrigger)
 	{
 		return;
 	}
-	TotalAlloc = 0;
-	_runGC();
+	if (!Concurrent)
+	{
+		collect(0);
+	}
+	else if (ConcPhase == CONC_IDLE)
+	{
+		initialMark();
+	}
+	else if (BytesSinceGC >= 2 * GCTrigger)
+	{
+		/* the marker fell behind: wait for it instead of growing the heap */
+		while (ConcPhase != CONC_IDLE)
+		{
+			pthread_cond_wait(&ConcCond, &HeapLock);
+		}
+	}
 }
 
 void printMemoryStats()
 {
+	pthread_mutex_lock(&HeapLock);
+	if (Self)
+	{
+		flushTlabStats(Self);
+	}
+	pthread_mutex_unlock(&HeapLock);
+
 	printf("Num Bytes Allocated: %lld\n", NumBytesAllocated);
 	printf("Num Bytes Freed: %lld\n", NumBytesFreed);
 	printf("Num GC Triggered: %lld\n", NumGCTriggered);
+
+	long long NumAttempts = NumFreeListHits + NumFreeListMisses;
+	printf("Free List Reuse: %lld/%lld (%.2f%%)\n", NumFreeListHits, NumAttempts,
+		NumAttempts ? (100.0 * NumFreeListHits) / NumAttempts : 0.0);
+
+	printf("GC Pause: total %.3f ms, max %.3f ms, roots %.3f ms, mark %.3f ms, sweep %.3f ms (%d mark threads, %d sweep threads)\n",
+		GCPauseTotal, GCPauseMax, GCRootScanTotal, GCMarkTotal, GCSweepTotal, NumMarkThreads, NumSweepThreads);
+	if (LazySweep)
+	{
+		printf("Lazy Sweep: %lld units swept by the allocator\n", NumLazySweepUnits);
+	}
+	if (Generational)
+	{
+		printf("Generational: %lld minor, %lld full collections\n", NumMinorGCs, NumGCTriggered - NumMinorGCs);
+	}
+	if (EvacuatePercent)
+	{
+		printf("Evacuation: %lld pages, %lld KB moved\n", NumPagesEvacuated, NumBytesEvacuated >> 10);
+	}
+	if (Concurrent)
+	{
+		printf("Concurrent Mark: %.3f ms alongside the mutator\n", GCConcMarkTotal);
+	}
+	if (PreciseStack)
+	{
+		printf("Precise Stack: %lld scans from stack maps, %lld conservative\n", NumPreciseStackScans, NumConservativeStackScans);
+	}
+	if (NumPauses)
+	{
+		int Bucket;
+		printf("Pause Histogram (%lld pauses):", NumPauses);
+		for (Bucket = 0; Bucket < NUM_PAUSE_BUCKETS; Bucket++)
+		{
+			if (Bucket == NUM_PAUSE_BUCKETS - 1)
+			{
+				printf(" >=%dms: %lld", 1 << (Bucket - 1), PauseHistogram[Bucket]);
+			}
+			else
+			{
+				printf(" <%dms: %lld", 1 << Bucket, PauseHistogram[Bucket]);
+			}
+		}
+		printf("\n");
+	}
+	if (NumGCTriggered)
+	{
+		printf("Survival: last %.2f%%, mean %.2f%%, min %.2f%%, max %.2f%% (live %lld KB, next GC after %lld KB)\n",
+			100 * SurvivalLast, 100 * SurvivalTotal / NumGCTriggered, 100 * SurvivalMin,
+			100 * SurvivalMax, LiveBytes >> 10, GCTrigger >> 10);
+	}
+
+	printf("Decommit: %lld pages in %lld calls\n", NumPagesDecommitted, NumDecommitCalls);
+	printf("Big Objects: %lld extents reused, %lld segments unmapped\n", NumBigExtentsReused, NumBigSegmentsReleased);
+
+	long long RSS = getRSS();
+	printf("RSS: %lld KB (%+lld KB since last report)\n", RSS >> 10, (RSS - RSSAtLastReport) / 1024);
+	RSSAtLastReport = RSS;
+}
+
+void GCGetStats(GCStats *Stats)
+{
+	pthread_mutex_lock(&HeapLock);
+	if (Self)
+	{
+		flushTlabStats(Self);
+	}
+	Stats->NumCollections = NumGCTriggered;
+	Stats->NumMinorCollections = NumMinorGCs;
+	Stats->BytesAllocated = NumBytesAllocated;
+	Stats->BytesFreed = NumBytesFreed;
+	Stats->ObjectsFreed = NumObjectsFreed;
+	Stats->LiveBytes = LiveBytes;
+	Stats->NextCollectionBytes = GCTrigger;
+	Stats->PauseTotal = GCPauseTotal;
+	Stats->PauseMax = GCPauseMax;
+	Stats->RootScanTotal = GCRootScanTotal;
+	Stats->MarkTotal = GCMarkTotal;
+	Stats->SweepTotal = GCSweepTotal;
+	Stats->ConcurrentMarkTotal = GCConcMarkTotal;
+	memcpy(Stats->PauseHistogram, PauseHistogram, sizeof(PauseHistogram));
+	Stats->PagesDecommitted = __atomic_load_n(&NumPagesDecommitted, __ATOMIC_RELAXED);
+	Stats->NumSegments = NumSegments;
+	Stats->Fragmentation = getFragmentation();
+	memcpy(Stats->AllocSizeHistogram, AllocSizeHistogram, sizeof(AllocSizeHistogram));
+	pthread_mutex_unlock(&HeapLock);
 }
 
 static ObjHeader* ObjToHeader(void *Obj) { return (ObjHeader*)((char*)Obj - OBJ_HEADER_SIZE); }
@@ -15,6 +15,12 @@
 #include <elf.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <setjmp.h>
+#include <errno.h>
 
 typedef unsigned long long ulong64;
 #define MAGIC_ADDR 0x12abcdef
@@ -22,16 +28,64 @@ typedef unsigned long long ulong64;
 
 #define SEGMENT_SIZE (4ULL << 32)
 #define PAGE_SIZE 4096
-#define METADATA_SIZE ((SEGMENT_SIZE/PAGE_SIZE) * 2)
-#define NUM_PAGES_IN_SEG (METADATA_SIZE/2)
+#define SIZE_METADATA_SIZE ((SEGMENT_SIZE/PAGE_SIZE) * 2)
+#define NUM_PAGES_IN_SEG (SIZE_METADATA_SIZE/2)
+/* one bit per 8-byte granule of the segment */
+#define GRANULE_SIZE 8
+#define BITMAP_SIZE (SEGMENT_SIZE/(GRANULE_SIZE * 8))
+#define NUM_BITMAP_WORDS (BITMAP_SIZE/sizeof(ulong64))
+#define BITMAP_WORDS_PER_PAGE (PAGE_SIZE/(GRANULE_SIZE * 64))
+/* one card byte per CARD_SIZE bytes of the segment, dirtied by the write barrier */
+#define CARD_SIZE 512
+#define NUM_CARDS (SEGMENT_SIZE/CARD_SIZE)
+#define METADATA_SIZE (SIZE_METADATA_SIZE + 2 * BITMAP_SIZE + NUM_CARDS)
 #define OTHER_METADATA_SIZE ((METADATA_SIZE/PAGE_SIZE) * 2)
-#define COMMIT_SIZE PAGE_SIZE
+/* larger objects get pages of their own in a big-object segment */
+#define MAX_SMALL_SIZE PAGE_SIZE
+/* small-object segments are committed this much at a time */
+#define COMMIT_SIZE (64ULL << 10)
+/* transparent huge page; segment data areas start on one */
+#define HUGE_PAGE_SIZE (2ULL << 20)
+#define ADDR_TO_HUGE_PAGE(x) (char*)(((ulong64)(x)) & ~(HUGE_PAGE_SIZE-1))
+/* freed pages queued by myfree before they are decommitted */
+#define DECOMMIT_BATCH_PAGES 256
 #define Align(x, y) (((x) + (y-1)) & ~(y-1))
 #define ADDR_TO_PAGE(x) (char*)(((ulong64)(x)) & ~(PAGE_SIZE-1))
 #define ADDR_TO_SEGMENT(x) (Segment*)(((ulong64)(x)) & ~(SEGMENT_SIZE-1))
+/* segments are aligned, so the bits above SEGMENT_SIZE index a flat table */
+#define SEGMENT_SHIFT 34
+#define ADDRESS_SPACE_BITS 48
+#define SEGMENT_TABLE_SIZE (1ULL << (ADDRESS_SPACE_BITS - SEGMENT_SHIFT))
+#define ADDR_TO_SEGMENT_INDEX(x) (((ulong64)(x)) >> SEGMENT_SHIFT)
 #define FREE 1
-#define MARK 2
+/* moved by the evacuation; Type holds the address of the copy */
+#define FORWARDED 2
+/*
+ * a collection starts once the bytes allocated since the last one exceed
+ * GC_GROWTH_PERCENT of the heap that survived it, within these bounds
+ */
 #define GC_THRESHOLD (32ULL << 20)
+#define GC_MAX_THRESHOLD (1ULL << 30)
+#define GC_GROWTH_PERCENT 100
+/* mark stack chunks: 64 KiB each, at most 256 MiB unless overridden */
+#define MARK_STACK_CHUNK_SIZE (64ULL << 10)
+#define MAX_MARK_STACK_CHUNKS 4096
+/* parallel marking and sweeping: at most this many GC threads, each with a deque of this many entries */
+#define MAX_GC_THREADS 64
+#define WORK_DEQUE_SIZE (1ULL << 16)
+/* signals that stop and restart the other mutator threads around a collection */
+#define SIG_SUSPEND SIGPWR
+#define SIG_RESUME SIGXCPU
+/* pages of small-object segments swept as one unit */
+#define SWEEP_UNIT_PAGES 256
+/* words filtered together by the aligned root scanner */
+#define SCAN_BATCH 8
+
+/* segregated free lists for small objects: 8, 16, 32, ..., 2048 bytes */
+#define MIN_SIZE_CLASS_SHIFT 3
+#define NUM_SIZE_CLASSES 9
+/* number of chunks inspected for a fit in a partially matching class */
+#define FIRST_FIT_LIMIT 8
 
 
 struct OtherMetadata
@@ -40,6 +94,10 @@ struct OtherMetadata
 	char *CommitPtr;
 	char *ReservePtr;
 	char *DataPtr;
+	char *BitmapCommitPtr;
+	char *CardCommitPtr;
+	/* start of the mapping the segment was aligned in, for munmap */
+	void *MapBase;
 	int BigAlloc;
 };
 
@@ -50,14 +108,25 @@ typedef struct Segment
 		unsigned short Size[NUM_PAGES_IN_SEG];
 		struct OtherMetadata Other;
 	};
+	/*
+	 * object-start bitmap of small-object segments: the bit of the
+	 * granule holding an allocated object's header is set. Committed
+	 * lazily along with the data it describes.
+	 */
+	ulong64 StartBitmap[NUM_BITMAP_WORDS];
+	/*
+	 * mark bitmap: the bit of a reachable object's header granule is
+	 * set while marking and the whole bitmap is cleared before the
+	 * next collection. Committed along with StartBitmap.
+	 */
+	ulong64 MarkBitmap[NUM_BITMAP_WORDS];
+	/*
+	 * card table of the generational mode: a card is dirty when a
+	 * store into it may have created an old-to-young pointer.
+	 */
+	unsigned char CardTable[NUM_CARDS];
 } Segment;
 
-typedef struct SegmentList
-{
-	struct Segment *Segment;
-	struct SegmentList *Next;
-} SegmentList;
-
 typedef struct ObjHeader
 {
 	unsigned Size;
@@ -68,8 +137,208 @@ typedef struct ObjHeader
 
 #define OBJ_HEADER_SIZE (sizeof(ObjHeader))
 
+/*
+ * A free hole inside a small-object page. The header keeps the
+ * Size and Status layout of ObjHeader so that page walks still work;
+ * the Type slot and the first payload word hold the list links.
+ */
+typedef struct FreeChunk
+{
+	unsigned Size;
+	unsigned short Status;
+	unsigned short Alignment;
+	struct FreeChunk *Next;
+	struct FreeChunk *Prev;
+} FreeChunk;
+
+#define MIN_FREE_CHUNK_SIZE (sizeof(FreeChunk))
+
+/*
+ * Grey objects waiting to be scanned. The stack grows in mmap'ed
+ * chunks; an emptied chunk is kept as a spare so that a stack
+ * oscillating around a chunk boundary does not map and unmap.
+ */
+typedef struct MarkStackChunk
+{
+	struct MarkStackChunk *Prev;
+	ObjHeader *Entries[];
+} MarkStackChunk;
+
+#define MARK_STACK_CHUNK_ENTRIES \
+	((MARK_STACK_CHUNK_SIZE - sizeof(MarkStackChunk)) / sizeof(ObjHeader*))
+
+typedef struct MarkStack
+{
+	MarkStackChunk *Chunk;
+	MarkStackChunk *Spare;
+	size_t Top;
+	size_t NumChunks;
+	/* a push was dropped: marked objects must be rescanned */
+	int Overflow;
+} MarkStack;
+
+/*
+ * Chase-Lev work-stealing deque of grey objects: the owning marker
+ * pushes and pops at Bottom, other markers steal at Top.
+ */
+typedef struct WorkDeque
+{
+	long Top;
+	long Bottom;
+	ObjHeader **Buffer;
+} WorkDeque;
+
+/* free pages of a big-object segment, indexed by log2 of their number */
+#define NUM_EXTENT_BUCKETS 24
+
+typedef struct BigExtent
+{
+	char *Start;
+	size_t Size;
+} BigExtent;
+
+/* a run of freed pages waiting to be decommitted */
+typedef struct DecommitRun
+{
+	char *Start;
+	size_t Size;
+} DecommitRun;
+
+/* a sparse small-object page whose survivors may be copied out */
+typedef struct EvacPage
+{
+	char *Page;
+	/* a conservative reference points into it, its objects must stay */
+	int Pinned;
+} EvacPage;
+
+/* overwritten values a thread logs before handing them to the concurrent marker */
+#define SATB_BUFFER_SIZE 256
+/* pause histogram: under 1 ms, then one bucket per power of two up to 1 s and more */
+#define NUM_PAUSE_BUCKETS 12
+/* allocation sizes are counted per power of two */
+#define NUM_ALLOC_SIZE_BUCKETS 33
+/* statepoint ID the SafeGCStatepoints pass gives the calls it rewrites */
+#define SAFEGC_STATEPOINT_ID 0x5afe6c00
+/* collections between two full collections in the generational mode */
+#define MINOR_PER_MAJOR 4
+
+/* a page range swept at once, possibly lazily or by another GC thread */
+typedef struct SweepUnit
+{
+	char *Start;
+	char *End;
+	int BigAlloc;
+} SweepUnit;
+
+/*
+ * Free runs found by a GC thread's sweeper. They stay on private
+ * lists until the parallel sweep ends and are then spliced into the
+ * global free lists.
+ */
+typedef struct SweepContext
+{
+	FreeChunk *Heads[NUM_SIZE_CLASSES];
+	FreeChunk *Tails[NUM_SIZE_CLASSES];
+	long long BytesFreed;
+	long long ObjectsFreed;
+	int Private;
+} SweepContext;
+
+typedef struct GCWorker
+{
+	/* serial markers only use Stack, parallel ones spill to it when Deque is full */
+	WorkDeque Deque;
+	MarkStack Stack;
+	SweepContext Sweep;
+	/* bytes of the objects this worker marked in the current cycle */
+	long long MarkedBytes;
+	int Parallel;
+	int Id;
+	pthread_t Thread;
+} GCWorker;
+
+/*
+ * A registered mutator thread. Small objects are bump-allocated from
+ * its buffer, a page or a hole taken from the free lists, without the
+ * heap lock. While the world is stopped the thread's stack from
+ * StackTop to StackBottom, which includes its saved registers, is
+ * scanned for roots.
+ */
+typedef struct GCThread
+{
+	char *TlabPtr;
+	char *TlabEnd;
+	/* allocations from the buffer not yet added to the global counters */
+	long long TlabBytes;
+	long long TlabObjects;
+	int TlabFromList;
+	/* the buffer was taken during concurrent marking: its objects are allocated marked */
+	int AllocBlack;
+	char *StackTop;
+	char *StackBottom;
+	pthread_t Thread;
+	/* a suspend request that arrives while a header is half written waits for InAlloc to clear */
+	volatile sig_atomic_t InAlloc;
+	volatile sig_atomic_t SuspendPending;
+	ulong64 SATBBuffer[SATB_BUFFER_SIZE];
+	int SATBCount;
+	/* allocation sizes counted since the buffer statistics were last flushed */
+	long long AllocSizes[NUM_ALLOC_SIZE_BUCKETS];
+	struct GCThread *Next;
+} GCThread;
+
+/*
+ * A dumpHeap() file is a HeapDumpHeader, NumRoots object addresses the
+ * roots refer to, then NumObjects HeapDumpObjects, each followed by the
+ * NumEdges addresses of the live objects it points to. Addresses are
+ * those of the object headers; Size includes the header.
+ */
+#define HEAP_DUMP_MAGIC 0x3150414548434753ULL /* "SGCHEAP1" */
+
+typedef struct HeapDumpHeader
+{
+	ulong64 Magic;
+	ulong64 NumRoots;
+	ulong64 NumObjects;
+} HeapDumpHeader;
+
+typedef struct HeapDumpObject
+{
+	ulong64 Addr;
+	ulong64 Type;
+	unsigned Size;
+	unsigned NumEdges;
+} HeapDumpObject;
+
+/* what GCGetStats() reports; times are in milliseconds */
+typedef struct GCStats
+{
+	long long NumCollections;
+	long long NumMinorCollections;
+	long long BytesAllocated;
+	long long BytesFreed;
+	long long ObjectsFreed;
+	long long LiveBytes;
+	long long NextCollectionBytes;
+	double PauseTotal;
+	double PauseMax;
+	double RootScanTotal;
+	double MarkTotal;
+	double SweepTotal;
+	double ConcurrentMarkTotal;
+	long long PauseHistogram[NUM_PAUSE_BUCKETS];
+	long long PagesDecommitted;
+	int NumSegments;
+	/* free bytes on partly used small-object pages over the size of those pages */
+	double Fragmentation;
+	/*
+	 * bucket i counts the allocations of [2^i, 2^(i+1)) bytes, header
+	 * included; only filled with SAFEGC_LOG or SAFEGC_ALLOC_HISTOGRAM.
+	 */
+	long long AllocSizeHistogram[NUM_ALLOC_SIZE_BUCKETS];
+} GCStats;
 
-static SegmentList *Segments = NULL;
 
 void *mymalloc(size_t Size);
 void printMemoryStats();
@@ -81,4 +350,13 @@ void myfree(void *Ptr);
 void* GetAlignedAddr(void *Addr, size_t Alignment);
 int readArgv(const char *argv[], int idx);
 ObjHeader* getObjectHeader(char *addr);
+void GCRegisterThread();
+void GCUnregisterThread();
+void GCRecordWrite(void *Addr, size_t Size);
+void GCPreWrite(void *Addr, size_t Size);
+void GCGetStats(GCStats *Stats);
+int dumpHeap(const char *Path);
+int loadStackMaps();
+int scanStackPrecisely(GCWorker *Marker, void (*Scan)(GCWorker*, unsigned char*, unsigned char*),
+	unsigned char *Top, unsigned char *Bottom);
 #endif
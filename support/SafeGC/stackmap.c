@@ -0,0 +1,375 @@
+/*
+ * Precise stack scanning (SAFEGC_PRECISE_STACK=1).
+ *
+ * Programs compiled with -safegc-statepoints call everything that can
+ * reach the collector through a gc.statepoint. LLVM then records, in the
+ * .llvm_stackmaps section, where the values that are live across each of
+ * these calls were spilled. The pass passes them as deopt operands in
+ * pairs: a size followed by a location. A size of 0 means the location
+ * holds a pointer; otherwise the location is a stack object (an alloca) of
+ * that many bytes, all of which is scanned.
+ *
+ * The pass also keeps the frame pointer in every function it rewrites, so
+ * the frames of the collecting thread are walked along the %rbp chain,
+ * starting at the frame mem.s pushes under MAGIC_ADDR. Each return address
+ * must be a statepoint; the walk stops at the first one that is not, and
+ * the rest of the stack is scanned conservatively. If a statepoint is
+ * found there (a callback from code without stack maps, whose registers a
+ * precisely scanned frame may have saved), the whole stack is scanned
+ * conservatively instead.
+ */
+#define _GNU_SOURCE
+
+#include <link.h>
+#include "memory.h"
+
+/* stack map format version 3; see llvm/docs/StackMaps.rst */
+#define STACK_MAP_VERSION 3
+#define LOC_REGISTER 1
+#define LOC_DIRECT 2
+#define LOC_INDIRECT 3
+#define LOC_CONSTANT 4
+#define LOC_CONST_INDEX 5
+#define DWARF_RBP 6
+#define DWARF_RSP 7
+/* calling convention, flags and the number of deopt operands */
+#define NUM_STATEPOINT_HEADER_LOCS 3
+
+/* mem.s pushes %rbx and %r12-%r15 between its saved %rbp and the marker */
+#define MAGIC_TO_FRAME (6 * sizeof(ulong64))
+
+typedef struct StackMapLocation
+{
+	unsigned char Type;
+	unsigned char Reserved;
+	unsigned short Size;
+	unsigned short Reg;
+	unsigned short Reserved2;
+	int Offset;
+} StackMapLocation;
+
+typedef struct CallSite
+{
+	ulong64 ReturnAddr;
+	StackMapLocation *Locations;
+	ulong64 *Constants;
+	unsigned NumLocations;
+} CallSite;
+
+static CallSite *CallSites = NULL;
+static int NumCallSites = 0;
+/* 0 before loadStackMaps(), 1 when stack maps were found, -1 otherwise */
+static int StackMapState = 0;
+
+static char *alignPtr(char *Ptr)
+{
+	return (char*)Align((ulong64)Ptr, sizeof(ulong64));
+}
+
+static int compareCallSites(const void *A, const void *B)
+{
+	ulong64 X = ((const CallSite*)A)->ReturnAddr;
+	ulong64 Y = ((const CallSite*)B)->ReturnAddr;
+	return X < Y ? -1 : X > Y;
+}
+
+static CallSite *findCallSite(ulong64 ReturnAddr)
+{
+	int Lo = 0, Hi = NumCallSites;
+
+	while (Lo < Hi)
+	{
+		int Mid = Lo + (Hi - Lo) / 2;
+		if (CallSites[Mid].ReturnAddr < ReturnAddr)
+		{
+			Lo = Mid + 1;
+		}
+		else
+		{
+			Hi = Mid;
+		}
+	}
+	if (Lo < NumCallSites && CallSites[Lo].ReturnAddr == ReturnAddr)
+	{
+		return &CallSites[Lo];
+	}
+	return NULL;
+}
+
+/* only statepoints of the SafeGC pass whose values were all spilled can be used */
+static int isUsableRecord(ulong64 ID, StackMapLocation *Locations, unsigned NumLocations)
+{
+	unsigned Idx;
+
+	if (ID != SAFEGC_STATEPOINT_ID || NumLocations < NUM_STATEPOINT_HEADER_LOCS)
+	{
+		return 0;
+	}
+	for (Idx = 0; Idx < NumLocations; Idx++)
+	{
+		if (Locations[Idx].Type == LOC_REGISTER)
+		{
+			return 0;
+		}
+		if (Locations[Idx].Type != LOC_CONSTANT && Locations[Idx].Type != LOC_CONST_INDEX
+			&& Locations[Idx].Reg != DWARF_RSP && Locations[Idx].Reg != DWARF_RBP)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * the linker concatenates the stack maps of all object files; each starts
+ * with its own header and constant pool
+ */
+static void parseStackMaps(char *Ptr, char *End, int Count)
+{
+	while (Ptr + 16 <= End && Ptr[0] == STACK_MAP_VERSION)
+	{
+		unsigned NumFunctions = *(unsigned*)(Ptr + 4);
+		unsigned NumConstants = *(unsigned*)(Ptr + 8);
+		ulong64 *Functions = (ulong64*)(Ptr + 16);
+		ulong64 *Constants = Functions + 3 * NumFunctions;
+		unsigned FuncIdx;
+
+		Ptr = (char*)(Constants + NumConstants);
+		for (FuncIdx = 0; FuncIdx < NumFunctions; FuncIdx++)
+		{
+			ulong64 FuncAddr = Functions[3 * FuncIdx];
+			ulong64 NumRecords = Functions[3 * FuncIdx + 2];
+			ulong64 RecIdx;
+
+			for (RecIdx = 0; RecIdx < NumRecords; RecIdx++)
+			{
+				ulong64 ID = *(ulong64*)Ptr;
+				unsigned Offset = *(unsigned*)(Ptr + 8);
+				unsigned NumLocations = *(unsigned short*)(Ptr + 14);
+				StackMapLocation *Locations = (StackMapLocation*)(Ptr + 16);
+
+				Ptr = alignPtr((char*)(Locations + NumLocations));
+				unsigned NumLiveOuts = *(unsigned short*)(Ptr + 2);
+				Ptr = alignPtr(Ptr + 4 + 4 * NumLiveOuts);
+
+				if (!isUsableRecord(ID, Locations, NumLocations))
+				{
+					continue;
+				}
+				if (Count)
+				{
+					NumCallSites++;
+					continue;
+				}
+				CallSite *Site = &CallSites[NumCallSites++];
+				Site->ReturnAddr = FuncAddr + Offset;
+				Site->Locations = Locations;
+				Site->Constants = Constants;
+				Site->NumLocations = NumLocations;
+			}
+		}
+	}
+}
+
+static int findLoadBias(struct dl_phdr_info *Info, size_t Size, void *Bias)
+{
+	/* the main program comes first */
+	*(ulong64*)Bias = Info->dlpi_addr;
+	return 1;
+}
+
+/* the .llvm_stackmaps section of the executable, as loaded */
+static char *findStackMapSection(size_t *SecSize)
+{
+	char Exec[PATH_SZ];
+	char *Section = NULL;
+	ulong64 Bias = 0;
+
+	ssize_t Count = readlink("/proc/self/exe", Exec, PATH_SZ - 1);
+	if (Count == -1)
+	{
+		return NULL;
+	}
+	Exec[Count] = '\0';
+
+	int fd = open(Exec, O_RDONLY);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+
+	struct stat Statbuf;
+	fstat(fd, &Statbuf);
+
+	char *Base = mmap(NULL, Statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (Base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	Elf64_Ehdr *Header = (Elf64_Ehdr*)Base;
+	if (memcmp(Header->e_ident, ELFMAG, SELFMAG) == 0)
+	{
+		int i;
+		Elf64_Shdr *Shdr = (Elf64_Shdr*)(Base + Header->e_shoff);
+		char *Strtab = Base + Shdr[Header->e_shstrndx].sh_offset;
+
+		dl_iterate_phdr(findLoadBias, &Bias);
+		for (i = 0; i < Header->e_shnum; i++)
+		{
+			if (!strcmp(Strtab + Shdr[i].sh_name, ".llvm_stackmaps") && (Shdr[i].sh_flags & SHF_ALLOC))
+			{
+				Section = (char*)(Shdr[i].sh_addr + Bias);
+				*SecSize = Shdr[i].sh_size;
+				break;
+			}
+		}
+	}
+	munmap(Base, Statbuf.st_size);
+	return Section;
+}
+
+int loadStackMaps()
+{
+	size_t SecSize = 0;
+
+	if (StackMapState)
+	{
+		return StackMapState > 0;
+	}
+	StackMapState = -1;
+
+	char *Section = findStackMapSection(&SecSize);
+	if (Section == NULL)
+	{
+		return 0;
+	}
+	parseStackMaps(Section, Section + SecSize, 1);
+	if (NumCallSites == 0)
+	{
+		return 0;
+	}
+	CallSites = malloc(NumCallSites * sizeof(CallSite));
+	if (CallSites == NULL)
+	{
+		printf("unable to allocate stack maps\n");
+		exit(0);
+	}
+	NumCallSites = 0;
+	parseStackMaps(Section, Section + SecSize, 0);
+	qsort(CallSites, NumCallSites, sizeof(CallSite), compareCallSites);
+	StackMapState = 1;
+	return 1;
+}
+
+static ulong64 getConstant(CallSite *Site, StackMapLocation *Loc)
+{
+	return (Loc->Type == LOC_CONST_INDEX) ? Site->Constants[Loc->Offset] : (ulong64)(long long)Loc->Offset;
+}
+
+/* the stack address a Direct or Indirect location is relative to */
+static char *getLocationAddr(StackMapLocation *Loc, char *SP, char *FP)
+{
+	return ((Loc->Reg == DWARF_RSP) ? SP : FP) + Loc->Offset;
+}
+
+static void scanCallSite(CallSite *Site, char *SP, char *FP, GCWorker *Marker,
+	void (*Scan)(GCWorker*, unsigned char*, unsigned char*))
+{
+	unsigned Idx;
+
+	for (Idx = NUM_STATEPOINT_HEADER_LOCS; Idx + 1 < Site->NumLocations; Idx += 2)
+	{
+		StackMapLocation *SizeLoc = &Site->Locations[Idx];
+		StackMapLocation *Loc = &Site->Locations[Idx + 1];
+		ulong64 Size;
+
+		/* null and other constant pointers */
+		if (Loc->Type == LOC_CONSTANT || Loc->Type == LOC_CONST_INDEX)
+		{
+			continue;
+		}
+		if (SizeLoc->Type == LOC_CONSTANT || SizeLoc->Type == LOC_CONST_INDEX)
+		{
+			Size = getConstant(Site, SizeLoc);
+		}
+		else
+		{
+			/* the size of a variable length array was spilled too */
+			Size = *(ulong64*)getLocationAddr(SizeLoc, SP, FP);
+		}
+
+		unsigned char *Addr = (unsigned char*)getLocationAddr(Loc, SP, FP);
+		if (Size == 0)
+		{
+			Scan(Marker, Addr, Addr + sizeof(ulong64));
+		}
+		else
+		{
+			/* a Direct location is the stack object, an Indirect one holds its address */
+			unsigned char *Object = (Loc->Type == LOC_DIRECT) ? Addr : *(unsigned char**)Addr;
+			Scan(Marker, Object, Object + Size);
+		}
+	}
+}
+
+/* does the conservatively scanned part of the stack contain a statepoint's return address? */
+static int hasStatepointFrames(unsigned char *Top, unsigned char *Bottom)
+{
+	ulong64 *Word = (ulong64*)Align((ulong64)Top, sizeof(ulong64));
+	ulong64 *End = (ulong64*)((ulong64)Bottom & ~(sizeof(ulong64) - 1));
+
+	for (; Word < End; Word++)
+	{
+		if (findCallSite(*Word))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * scans the stack of the collecting thread between the marker at Top and
+ * Bottom; returns 0, having scanned nothing, when the stack maps can not
+ * describe it
+ */
+int scanStackPrecisely(GCWorker *Marker, void (*Scan)(GCWorker*, unsigned char*, unsigned char*),
+	unsigned char *Top, unsigned char *Bottom)
+{
+	char **FP = (char**)(Top + MAGIC_TO_FRAME);
+	char **Start = FP;
+	int NumFrames = 0;
+
+	if (StackMapState <= 0)
+	{
+		return 0;
+	}
+
+	/* find the frames described by stack maps; FP[0] is the caller's %rbp, FP[1] the return address */
+	while (findCallSite((ulong64)FP[1]))
+	{
+		char **CallerFP = (char**)FP[0];
+		if (CallerFP <= FP + 1 || (unsigned char*)CallerFP >= Bottom)
+		{
+			return 0;
+		}
+		FP = CallerFP;
+		NumFrames++;
+	}
+	/* the registers mem.s saved belong to the first frame */
+	if (NumFrames == 0 || hasStatepointFrames((unsigned char*)(FP + 2), Bottom))
+	{
+		return 0;
+	}
+
+	char **End = FP;
+	for (FP = Start; FP != End; FP = (char**)FP[0])
+	{
+		/* the caller's stack pointer was just above the return address */
+		scanCallSite(findCallSite((ulong64)FP[1]), (char*)(FP + 2), FP[0], Marker, Scan);
+	}
+	Scan(Marker, (unsigned char*)(End + 2), Bottom);
+	return 1;
+}
@@ -34,8 +34,16 @@ int isTypeVariantValidTillLen(int srcBitMapArray[], unsigned srcNumFields, int d
 	return 1;
 }
 
+// only the terminator is set: the type has no pointer fields
+int isPointerFree(u64 bitMap) {
+	return bitMap && (bitMap & (bitMap - 1)) == 0;
+}
+
 int checkTypeVar(u64 srcBitmap, u64 dstBitmap, unsigned SrcSize) {
-	// now 1 and 0 condtions not possible
+	// an object cast to a pointer-free type may meet a pointer-holding one here
+	if (isPointerFree(srcBitmap) || isPointerFree(dstBitmap))
+		return isPointerFree(srcBitmap) && isPointerFree(dstBitmap);
+
 	unsigned srcNumFields = getNumFields(srcBitmap);
 	unsigned dstNumFields = getNumFields(dstBitmap);
 
@@ -101,6 +109,25 @@ void BoundsCheckWithSize(void *RealBase, void *Ptr, size_t Size, size_t AccessSi
 	}
 }
 
+/* called by the inline checks MemSafe emits */
+void BoundsCheckFailed()
+{
+	printf("Aborting due to BoundsCheck\n");
+	exit(0);
+}
+
+/* start and size of the object Base points into, or {NULL, 0}, which fails every check */
+ObjBounds GetObjectBounds(void *Base)
+{
+	ObjBounds Bounds = { NULL, 0 };
+	ObjHeader *objHeader = getObjectHeader((char*)Base);
+	if (objHeader) {
+		Bounds.Start = (char*)objHeader + OBJ_HEADER_SIZE;
+		Bounds.Size = objHeader->Size - OBJ_HEADER_SIZE;
+	}
+	return Bounds;
+}
+
 void BoundsCheck(void *Base, void *Ptr, size_t AccessSize)
 {
 	ObjHeader *objHeader = getObjectHeader((char*)Base);
@@ -122,6 +149,7 @@ int findPosLastSetBit(unsigned long long Type){
 void WriteBarrierWithSize(void *RealBase, void *Ptr, size_t Size,
 	size_t AccessSize, unsigned long long Type)
 {
+	GCRecordWrite(Ptr, AccessSize);
 	if(Type == 0)
 		return;
 	
@@ -3,9 +3,18 @@
 
 #include <stddef.h>
 
+/* what GetObjectBounds() returns, in two registers */
+typedef struct ObjBounds
+{
+	char *Start;
+	size_t Size;
+} ObjBounds;
+
 void checkSizeInv(void *Dst, unsigned DstSize);
 void checkTypeAndSizeInv(void *Src, unsigned long long DstType, unsigned DstSize);
 void checkTypeInv(void *Src, unsigned long long DstType);
 void* mycast(void *Ptr, unsigned long long Bitmap, unsigned Size);
+ObjBounds GetObjectBounds(void *Base);
+void BoundsCheckFailed();
 
 #endif
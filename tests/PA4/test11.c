@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+int __attribute__((noinline)) sum(int *arr, int n) {
+	int i, total = 0;
+	for (i = 0; i < n; i++) {
+		total += arr[i];
+	}
+	return total;
+}
+
+int __attribute__((noinline)) length(int *arr) {
+	int i = 0;
+	while (arr[i] != 0) {
+		i++;
+	}
+	return i;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc != 3) {
+		printf("Usage:: <size> <count>\n");
+		return 0;
+	}
+	int size = readArgv(argv, 1);
+	int count = readArgv(argv, 2);
+	int *arr = mymalloc(size * sizeof(int));
+	int i;
+	for (i = 0; i < size; i++) {
+		arr[i] = i + 1;
+	}
+	if (count < size) {
+		arr[count] = 0;
+	}
+	printf("sum %d\n", sum(arr, count));
+	printf("length %d\n", length(arr));
+	return 0;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+struct Point {
+	int x;
+	int y;
+	int z;
+};
+
+int table[8];
+
+void __attribute__((noinline)) init(struct Point *p, int v) {
+	p->x = v;
+	p->y = v + 1;
+	p->z = v + 2;
+}
+
+int main(int argc, const char *argv[])
+{
+	struct Point p;
+	if (argc != 2) {
+		printf("Usage:: <value>\n");
+		return 0;
+	}
+	init(&p, readArgv(argv, 1));
+	table[0] = p.x;
+	table[7] = p.z;
+	printf("%d\n", table[0] + table[7] + p.y);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+int main(int argc, const char *argv[])
+{
+	if (argc != 2) {
+		printf("Usage:: <value>\n");
+		return 0;
+	}
+	int value = readArgv(argv, 1);
+	int *arr = mymalloc(4 * sizeof(int));
+	arr[0] = value;
+	arr[3] = value;
+	printf("%d\n", arr[0] + arr[3]);
+	arr[4] = value;
+	printf("%d\n", arr[4]);
+	return 0;
+}